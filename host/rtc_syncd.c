@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+// Keeps the RTCs of many RedBoards in sync with this host's clock. Every board
+// is driven concurrently from one epoll loop, over the same ping and
+// change_time commands of the text CLI that update_rtc_redboard.py uses. Pings
+// are pipelined, the next ping command is queued right behind each response,
+// and each round keeps only the exchange with the smallest round trip, whose
+// offset is the least disturbed by queuing and scheduling delays.
+
+#include <sys/epoll.h>
+
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#define MAX_BOARDS 64
+#define LINE_SIZE 128
+
+// How long a board gets to answer before it is poked again, in microseconds
+#define ANSWER_TIMEOUT 2000000
+
+enum board_state
+{
+	// Waiting for the next round
+	BOARD_IDLE,
+	// ping sent, waiting for the device's request
+	BOARD_REQUEST,
+	// Response sent, waiting for the device's timestamps
+	BOARD_STAMPS,
+	// change_time sent, waiting for its report
+	BOARD_ADJUST,
+	// Finished, only with --once
+	BOARD_DONE,
+};
+
+struct board
+{
+	const char *port;
+	int fd;
+	enum board_state state;
+	char line[LINE_SIZE];
+	size_t length;
+	// Host time of the read that returned the first byte of line
+	int64_t line_stamp;
+	// Host timestamps of the current exchange, in microseconds
+	int64_t received;
+	int64_t sent;
+	// Whether the next ping is already queued behind the current exchange
+	bool pipelined;
+	// Exchanges so far this round, and the one with the smallest round trip
+	unsigned samples;
+	int64_t best_offset;
+	int64_t best_delay;
+	unsigned adjustments;
+	bool synced;
+	// Host time at which the board needs attention again
+	int64_t deadline;
+};
+
+struct options
+{
+	// Pings per round
+	unsigned samples;
+	// Largest offset left alone, in microseconds
+	int64_t threshold;
+	// Time between rounds of a board in sync, in microseconds
+	int64_t interval;
+	// Stop once every board is in sync, giving up after max_adjustments
+	bool once;
+	unsigned max_adjustments;
+};
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int open_port(const char *path)
+{
+	int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	struct termios tty;
+	if (tcgetattr(fd, &tty) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	cfmakeraw(&tty);
+	cfsetspeed(&tty, B115200);
+	tty.c_cflag |= CLOCAL | CREAD;
+	if (tcsetattr(fd, TCSANOW, &tty) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+static bool send_text(struct board *board, const char *text)
+{
+	size_t size = strlen(text);
+	while (size)
+	{
+		ssize_t written = write(board->fd, text, size);
+		if (written < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: write: %s\n", board->port, strerror(errno));
+			return false;
+		}
+		text += written;
+		size -= written;
+	}
+	return true;
+}
+
+static void start_round(struct board *board, int64_t now)
+{
+	board->samples = 0;
+	board->best_delay = INT64_MAX;
+	board->state = BOARD_REQUEST;
+	board->deadline = now + ANSWER_TIMEOUT;
+	send_text(board, "ping\r\n");
+}
+
+static void finish(struct board *board, bool synced, int64_t now, const struct options *options)
+{
+	board->synced = synced;
+	if (options->once)
+	{
+		board->state = BOARD_DONE;
+		return;
+	}
+	board->state = BOARD_IDLE;
+	board->deadline = now + options->interval;
+}
+
+static void finish_round(struct board *board, int64_t now, const struct options *options)
+{
+	int64_t offset = board->best_offset;
+	printf("%s offset %" PRId64 " us delay %" PRId64 " us over %u pings\n",
+		board->port, offset, board->best_delay, board->samples);
+
+	if (llabs(offset) <= options->threshold)
+	{
+		finish(board, true, now, options);
+		return;
+	}
+	if (options->once && board->adjustments >= options->max_adjustments)
+	{
+		printf("%s not in sync after %u adjustments\n", board->port, board->adjustments);
+		finish(board, false, now, options);
+		return;
+	}
+
+	// The offset goes out in seconds as a decimal, without floating point
+	int64_t magnitude = llabs(offset);
+	char command[64];
+	snprintf(command, sizeof(command), "change_time %s%" PRId64 ".%06" PRId64 " adjust\r\n",
+		offset < 0 ? "-" : "", magnitude / 1000000, magnitude % 1000000);
+	board->adjustments += 1;
+	board->state = BOARD_ADJUST;
+	board->deadline = now + ANSWER_TIMEOUT;
+	send_text(board, command);
+}
+
+static void handle_line(struct board *board, const char *line, int64_t stamp, const struct options *options)
+{
+	switch (board->state)
+	{
+	case BOARD_REQUEST:
+	{
+		if (strcmp(line, "request"))
+			return;
+		// Queue the next ping right behind the response, so the board starts
+		// on it as soon as it has sent its timestamps
+		board->pipelined = board->samples + 1 < options->samples;
+		board->received = stamp;
+		board->sent = now_us();
+		send_text(board, board->pipelined ? "response\r\nping\r\n" : "response\r\n");
+		board->state = BOARD_STAMPS;
+		board->deadline = board->sent + ANSWER_TIMEOUT;
+		return;
+	}
+	case BOARD_STAMPS:
+	{
+		int64_t request_sec, response_sec;
+		long request_usec, response_usec;
+		int end = 0;
+		if (sscanf(line, "%" SCNd64 " %ld %" SCNd64 " %ld%n",
+				&request_sec, &request_usec, &response_sec, &response_usec, &end) != 4 ||
+			line[end])
+			return;
+
+		// NTP style offset and round trip, the device stamped sending its
+		// request (t0) and receiving the response (t3)
+		int64_t t0 = request_sec * 1000000 + request_usec;
+		int64_t t3 = response_sec * 1000000 + response_usec;
+		int64_t offset = ((board->received - t0) + (board->sent - t3)) / 2;
+		int64_t delay = (t3 - t0) - (board->sent - board->received);
+		if (delay < board->best_delay)
+		{
+			board->best_delay = delay;
+			board->best_offset = offset;
+		}
+		board->samples += 1;
+
+		if (board->pipelined)
+		{
+			board->state = BOARD_REQUEST;
+			board->deadline = stamp + ANSWER_TIMEOUT;
+		}
+		else
+		{
+			finish_round(board, stamp, options);
+		}
+		return;
+	}
+	case BOARD_ADJUST:
+	{
+		if (strncmp(line, "applied", 7) && strncmp(line, "Error", 5))
+			return;
+		printf("%s %s\n", board->port, line);
+		// Measure again right away to confirm the step
+		start_round(board, stamp);
+		return;
+	}
+	default:
+		return;
+	}
+}
+
+static bool handle_input(struct board *board, const struct options *options)
+{
+	char buffer[256];
+	ssize_t size = read(board->fd, buffer, sizeof(buffer));
+	int64_t stamp = now_us();
+	if (size < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
+	if (size <= 0)
+		return false;
+
+	// Each line is stamped with the read its first byte came in, which is
+	// what matters for the request line. With pipelining it can share a read
+	// with the timestamps before it, or be split over two reads.
+	for (ssize_t i = 0; i < size; ++i)
+	{
+		char c = buffer[i];
+		if (c == '\r')
+			continue;
+		if (c != '\n')
+		{
+			if (!board->length)
+				board->line_stamp = stamp;
+			if (board->length < LINE_SIZE - 1)
+				board->line[board->length++] = c;
+			continue;
+		}
+		board->line[board->length] = '\0';
+		board->length = 0;
+		handle_line(board, board->line, board->line_stamp, options);
+	}
+	return true;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-n pings] [-t threshold_us] [-i interval_s] [-1 [-m adjustments]] port...\n"
+		"  -n  pings per round, the one with the smallest round trip is used (16)\n"
+		"  -t  largest offset left uncorrected, in microseconds (10000)\n"
+		"  -i  seconds between rounds of a board in sync (60)\n"
+		"  -1  exit once every board is in sync, with status 1 if any is not\n"
+		"  -m  adjustments per board before giving up with -1 (5)\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct options options = {
+		.samples = 16,
+		.threshold = 10000,
+		.interval = 60000000,
+		.once = false,
+		.max_adjustments = 5,
+	};
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:t:i:1m:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			options.samples = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			options.threshold = strtoll(optarg, NULL, 0);
+			break;
+		case 'i':
+			options.interval = strtoll(optarg, NULL, 0) * 1000000;
+			break;
+		case '1':
+			options.once = true;
+			break;
+		case 'm':
+			options.max_adjustments = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	size_t count = argc - optind;
+	if (!count || count > MAX_BOARDS || !options.samples)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	int epoll = epoll_create1(0);
+	if (epoll < 0)
+	{
+		perror("epoll_create1");
+		return 1;
+	}
+
+	static struct board boards[MAX_BOARDS];
+	int64_t now = now_us();
+	for (size_t i = 0; i < count; ++i)
+	{
+		struct board *board = &boards[i];
+		board->port = argv[optind + i];
+		board->fd = open_port(board->port);
+		if (board->fd < 0)
+		{
+			fprintf(stderr, "%s: %s\n", board->port, strerror(errno));
+			return 1;
+		}
+		struct epoll_event event = {.events = EPOLLIN, .data.ptr = board};
+		epoll_ctl(epoll, EPOLL_CTL_ADD, board->fd, &event);
+		// Clear out anything half typed before the first command
+		send_text(board, "\r\n");
+		start_round(board, now);
+	}
+
+	for (;;)
+	{
+		// Sleep until the earliest board deadline
+		bool active = false;
+		int64_t next = INT64_MAX;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (boards[i].state == BOARD_DONE)
+				continue;
+			active = true;
+			if (boards[i].deadline < next)
+				next = boards[i].deadline;
+		}
+		if (!active)
+			break;
+		now = now_us();
+		int timeout = next <= now ? 0 : (int)((next - now + 999) / 1000);
+
+		struct epoll_event events[MAX_BOARDS];
+		int ready = epoll_wait(epoll, events, MAX_BOARDS, timeout);
+		if (ready < 0 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			return 1;
+		}
+		for (int i = 0; i < ready; ++i)
+		{
+			struct board *board = events[i].data.ptr;
+			if (!handle_input(board, &options))
+			{
+				fprintf(stderr, "%s: port closed\n", board->port);
+				epoll_ctl(epoll, EPOLL_CTL_DEL, board->fd, NULL);
+				board->synced = false;
+				board->state = BOARD_DONE;
+				if (!options.once)
+					return 1;
+			}
+		}
+
+		now = now_us();
+		for (size_t i = 0; i < count; ++i)
+		{
+			struct board *board = &boards[i];
+			if (board->state == BOARD_DONE || board->deadline > now)
+				continue;
+			if (board->state != BOARD_IDLE)
+			{
+				// Finish whatever the board is blocked on and start over
+				fprintf(stderr, "%s: no answer, retrying\n", board->port);
+				send_text(board, "\r\n");
+			}
+			start_round(board, now);
+		}
+		fflush(stdout);
+	}
+
+	int status = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!boards[i].synced)
+			status = 1;
+	}
+	return status;
+}
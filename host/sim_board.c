@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+// Simulated RedBoards, for running host tools such as rtc_syncd without
+// hardware. Each board is a pty whose slave path is printed on startup, and
+// which answers the ping and change_time commands like the firmware's text
+// CLI. Its RTC runs off the host clock with an offset and a rate error, and
+// each ping request goes out after a random delay, so some exchanges have
+// longer round trips than others.
+
+#include <sys/epoll.h>
+
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#define MAX_BOARDS 64
+#define LINE_SIZE 128
+
+struct sim_board
+{
+	int master;
+	int slave;
+	char line[LINE_SIZE];
+	size_t length;
+	// RTC time is host time + offset + drift since start, in microseconds
+	int64_t offset;
+	int64_t start;
+	double drift;
+	// Ping in progress: the request timestamp, when the request goes out, and
+	// whether the response's first byte was seen yet
+	bool pinging;
+	int64_t request;
+	int64_t request_due;
+	bool request_sent;
+	bool responding;
+	int64_t response;
+};
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t board_time(const struct sim_board *board, int64_t host)
+{
+	return host + board->offset + (int64_t)((host - board->start) * board->drift);
+}
+
+static void send_text(struct sim_board *board, const char *text)
+{
+	size_t size = strlen(text);
+	while (size)
+	{
+		ssize_t written = write(board->master, text, size);
+		if (written < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return;
+		}
+		text += written;
+		size -= written;
+	}
+}
+
+static bool open_board(struct sim_board *board)
+{
+	board->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (board->master < 0 || grantpt(board->master) || unlockpt(board->master))
+		return false;
+	const char *name = ptsname(board->master);
+	if (!name)
+		return false;
+
+	// Keep the slave open, so the master doesn't hang up between clients, and
+	// make it a raw line like the RedBoard's UART
+	board->slave = open(name, O_RDWR | O_NOCTTY);
+	if (board->slave < 0)
+		return false;
+	struct termios tty;
+	tcgetattr(board->slave, &tty);
+	cfmakeraw(&tty);
+	tcsetattr(board->slave, TCSANOW, &tty);
+	fcntl(board->master, F_SETFL, O_NONBLOCK);
+
+	printf("%s\n", name);
+	return true;
+}
+
+static void handle_command(struct sim_board *board, const char *line, int64_t stamp, int64_t jitter)
+{
+	if (!strcmp(line, "ping"))
+	{
+		// The firmware stamps the request right after sending it
+		board->pinging = true;
+		board->request_sent = false;
+		board->responding = false;
+		board->request_due = stamp + (jitter ? rand() % jitter : 0);
+		return;
+	}
+
+	double seconds;
+	char mode[16] = "";
+	if (sscanf(line, "change_time %lf %15s", &seconds, mode) >= 1)
+	{
+		int64_t offset = (int64_t)(seconds * 1000000);
+		if (!strcmp(mode, "adjust"))
+		{
+			// The RTC only takes whole hundredths
+			int64_t applied = (offset >= 0 ? offset + 5000 : offset - 5000) / 10000 * 10000;
+			board->offset += applied;
+			char report[96];
+			snprintf(report, sizeof(report),
+				"applied %" PRId64 " us, residual %" PRId64 " us, window 40 us, attempts 1\r\n",
+				applied, offset - applied);
+			send_text(board, report);
+		}
+		else
+		{
+			board->offset += offset;
+		}
+	}
+}
+
+static void handle_input(struct sim_board *board, int64_t jitter)
+{
+	char buffer[256];
+	ssize_t size = read(board->master, buffer, sizeof(buffer));
+	int64_t stamp = now_us();
+	for (ssize_t i = 0; i < size; ++i)
+	{
+		char c = buffer[i];
+		// During a ping the firmware reads the response raw, stamping its
+		// first byte and draining the rest of the line
+		if (board->pinging && board->request_sent)
+		{
+			if (!board->responding)
+			{
+				board->responding = true;
+				board->response = board_time(board, stamp);
+			}
+			if (c == '\n')
+			{
+				char stamps[64];
+				snprintf(stamps, sizeof(stamps), "%" PRId64 " %ld %" PRId64 " %ld\r\n",
+					board->request / 1000000, (long)(board->request % 1000000),
+					board->response / 1000000, (long)(board->response % 1000000));
+				send_text(board, stamps);
+				board->pinging = false;
+			}
+			continue;
+		}
+		if (c == '\r')
+			continue;
+		if (c != '\n')
+		{
+			if (board->length < LINE_SIZE - 1)
+				board->line[board->length++] = c;
+			continue;
+		}
+		board->line[board->length] = '\0';
+		board->length = 0;
+		handle_command(board, board->line, stamp, jitter);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-n boards] [-o offset_us] [-d drift_ppm] [-j jitter_us]\n"
+		"  -n  number of boards (1)\n"
+		"  -o  initial RTC offset of the first board, board i gets i times it (250000)\n"
+		"  -d  RTC rate error, in parts per million (20)\n"
+		"  -j  largest random delay before a ping request goes out (2000)\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 1;
+	int64_t offset = 250000;
+	double drift = 20;
+	int64_t jitter = 2000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:o:d:j:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			offset = strtoll(optarg, NULL, 0);
+			break;
+		case 'd':
+			drift = strtod(optarg, NULL);
+			break;
+		case 'j':
+			jitter = strtoll(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (!count || count > MAX_BOARDS)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	int epoll = epoll_create1(0);
+	if (epoll < 0)
+	{
+		perror("epoll_create1");
+		return 1;
+	}
+
+	static struct sim_board boards[MAX_BOARDS];
+	int64_t now = now_us();
+	srand(now);
+	for (size_t i = 0; i < count; ++i)
+	{
+		struct sim_board *board = &boards[i];
+		if (!open_board(board))
+		{
+			perror("pty");
+			return 1;
+		}
+		board->offset = offset * (int64_t)(i + 1);
+		board->start = now;
+		board->drift = drift / 1000000;
+		struct epoll_event event = {.events = EPOLLIN, .data.ptr = board};
+		epoll_ctl(epoll, EPOLL_CTL_ADD, board->master, &event);
+	}
+	fflush(stdout);
+
+	for (;;)
+	{
+		// Sleep until the next delayed ping request is due
+		now = now_us();
+		int64_t next = INT64_MAX;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (boards[i].pinging && !boards[i].request_sent && boards[i].request_due < next)
+				next = boards[i].request_due;
+		}
+		int timeout = next == INT64_MAX ? -1 : next <= now ? 0 : (int)((next - now + 999) / 1000);
+
+		struct epoll_event events[MAX_BOARDS];
+		int ready = epoll_wait(epoll, events, MAX_BOARDS, timeout);
+		if (ready < 0 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			return 1;
+		}
+
+		// Requests go out before new input is looked at, a response can only
+		// follow its request
+		now = now_us();
+		for (size_t i = 0; i < count; ++i)
+		{
+			struct sim_board *board = &boards[i];
+			if (board->pinging && !board->request_sent && board->request_due <= now)
+			{
+				send_text(board, "request\r\n");
+				board->request = board_time(board, now_us());
+				board->request_sent = true;
+			}
+		}
+		for (int i = 0; i < ready; ++i)
+			handle_input(events[i].data.ptr, jitter);
+	}
+}
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <am1815.h>
+
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Nominal rate of the free-running MCU counter (STIMER clocked from HFRC / 16)
+#define CLOCK_TICKS_PER_SECOND 3000000u
+
+// How long an anchor is trusted before clock_service takes a new one
+#define CLOCK_ANCHOR_INTERVAL 60
+
+// Shortest time between anchors over which the counter rate is re-estimated
+#define CLOCK_RATE_MIN_INTERVAL 10
+
+// Longest time, in microseconds, from a hundredths rollover to the end of the
+// time write in clock_adjust. Well under a hundredth, so the written time is
+// never stale.
+#define CLOCK_ADJUST_MAX_WINDOW 2000
+
+// Rollovers clock_adjust waits for before giving up on meeting the window
+#define CLOCK_ADJUST_ATTEMPTS 5
+
+// Microsecond resolution clock built from the RTC and a free-running MCU
+// counter. The RTC is latched right at a hundredths rollover, when its time is
+// known exactly, and the counter extends it from there. The counter's actual
+// rate is measured against the RTC between anchors, so reads between anchors
+// stay as accurate as the RTC while costing no SPI traffic.
+struct clock
+{
+	struct am1815 *rtc;
+	// RTC time and counter value at the last anchor
+	struct timeval anchor_time;
+	uint64_t anchor_ticks;
+	// Measured counter rate, in ticks per RTC second
+	uint32_t rate;
+	// Last raw 32-bit counter value and the high bits of the extended count
+	uint32_t last_count;
+	uint64_t high;
+	// Duration of the last time write, used to start the next one early enough.
+	// Until a write has been timed, it is the duration of a time read, the
+	// same 8 byte SPI burst the other way.
+	uint64_t write_ticks;
+};
+
+// Outcome of a clock_adjust
+struct clock_adjustment
+{
+	// Offset actually applied, in microseconds, a whole number of hundredths
+	int64_t applied;
+	// Microseconds from the rollover the new time was computed from to the end
+	// of the write. Bounds the error of the step.
+	uint32_t window;
+	// Rollovers it took to fit the write in the window
+	unsigned attempts;
+};
+
+// Start the counter and anchor it to the RTC
+void clock_init(struct clock *clock, struct am1815 *rtc);
+
+// Wait for the next RTC hundredths rollover and take a new anchor there,
+// updating the rate estimate. Takes up to 10 ms of SPI polling.
+void clock_anchor(struct clock *clock);
+
+// Shift the RTC time by offset microseconds, rounded to whole hundredths. The
+// new time is computed from a hundredths rollover, where the RTC time is known
+// exactly, and written right after it, so no time is lost between reading and
+// writing the RTC. Takes a new anchor afterwards. Returns false, leaving the RTC
+// untouched, if no write fit in CLOCK_ADJUST_MAX_WINDOW.
+bool clock_adjust(struct clock *clock, int64_t offset, struct clock_adjustment *result);
+
+// Take a new anchor after the RTC time was written, without measuring the
+// counter rate against the now meaningless previous anchor
+void clock_resync(struct clock *clock);
+
+// Re-anchor if the current anchor is older than CLOCK_ANCHOR_INTERVAL. Call
+// this outside of timing critical sections.
+void clock_service(struct clock *clock);
+
+// Current counter value, extended to 64 bits
+uint64_t clock_ticks(struct clock *clock);
+
+// Convert a counter value to RTC time
+struct timeval clock_ticks_to_time(const struct clock *clock, uint64_t ticks);
+
+// Current RTC time with microsecond resolution, without any SPI traffic
+struct timeval clock_now(struct clock *clock);
+
+// Add a signed microsecond offset to a time, carrying into the seconds
+struct timeval timeval_add_us(struct timeval time, int64_t offset);
+
+#endif//CLOCK_H_
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Binary command framing, laid out like the SparkFun SVL bootloader packets
+// (see svl.py):
+//
+//   | length (2, BE) | opcode (1) | payload (length - 3) | CRC16 (2, BE) |
+//
+// length counts the opcode, payload, and CRC. The CRC16 (polynomial 0x8005,
+// initial value 0) is computed over the opcode and payload, so running it over
+// opcode, payload, and CRC yields 0. Multi-byte payload fields are big-endian
+// and fixed width.
+
+#define FRAME_MAX_PAYLOAD 64
+#define FRAME_OVERHEAD 5
+#define FRAME_MAX_SIZE (FRAME_MAX_PAYLOAD + FRAME_OVERHEAD)
+
+// Responses carry the opcode of their request with this bit set
+#define FRAME_RESPONSE 0x80
+
+enum frame_opcode
+{
+	// -> nothing
+	// <- seconds (8), microseconds (4)
+	FRAME_GET_TIME = 0x01,
+	// -> seconds (8), hundredths (1)
+	// <- nothing
+	FRAME_SET_TIME = 0x02,
+	// -> offset in microseconds (8, signed)
+	// <- new seconds (8), new microseconds (4)
+	FRAME_CHANGE_TIME = 0x03,
+	// -> nothing
+	// <- FRAME_PING_REQUEST, then after the host's FRAME_PING_RESPONSE:
+	//    request seconds (8), request microseconds (4),
+	//    response seconds (8), response microseconds (4)
+	FRAME_PING = 0x04,
+	// Sent by the device during a ping, answered by the host
+	FRAME_PING_REQUEST = 0x05,
+	FRAME_PING_RESPONSE = 0x06,
+	// -> address (1), size (1), not past register 0xFF
+	// <- data (size)
+	FRAME_READ = 0x07,
+	// -> address (1), data (1 or more), not past register 0xFF
+	// <- nothing
+	FRAME_WRITE = 0x08,
+	// -> nothing
+	// <- nothing, then the device goes back to the text CLI
+	FRAME_EXIT = 0x7F,
+	// <- error code (1), sent instead of a response
+	FRAME_ERROR = 0xFF,
+};
+
+enum frame_error
+{
+	FRAME_ERROR_CRC = 0x01,
+	FRAME_ERROR_LENGTH = 0x02,
+	FRAME_ERROR_OPCODE = 0x03,
+	FRAME_ERROR_ARGUMENT = 0x04,
+};
+
+struct frame
+{
+	uint8_t opcode;
+	uint8_t size;
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+};
+
+// Incremental frame parser, fed one received byte at a time
+struct frame_decoder
+{
+	uint8_t buffer[FRAME_MAX_SIZE];
+	size_t received;
+	size_t length;
+};
+
+// CRC16 as used by the SVL bootloader, continuing from crc
+uint16_t frame_crc16(uint16_t crc, const uint8_t *data, size_t size);
+
+// Serialize a frame into buffer, which must hold FRAME_MAX_SIZE bytes. Returns
+// the number of bytes to send.
+size_t frame_encode(const struct frame *frame, uint8_t *buffer);
+
+void frame_decoder_init(struct frame_decoder *decoder);
+
+// Feed one byte to the decoder. Returns 1 and fills frame when a valid frame
+// is complete, 0 if more bytes are needed, or a negative frame_error if the
+// frame was malformed, after which the decoder starts looking for a new frame.
+int frame_decoder_push(struct frame_decoder *decoder, uint8_t byte, struct frame *frame);
+
+// Big-endian field accessors for frame payloads
+void frame_put_u32(uint8_t *data, uint32_t value);
+void frame_put_u64(uint8_t *data, uint64_t value);
+uint32_t frame_get_u32(const uint8_t *data);
+uint64_t frame_get_u64(const uint8_t *data);
+
+#endif//FRAME_H_
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#ifndef IRQ_H_
+#define IRQ_H_
+
+#include <rtc.h>
+#include <clock.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// MCU pins wired to the RTC's FOUT/nIRQ and PSW/nIRQ2 outputs. Adjust these to
+// the board's wiring.
+#ifndef IRQ_NIRQ_PIN
+#define IRQ_NIRQ_PIN 39
+#endif
+#ifndef IRQ_NIRQ2_PIN
+#define IRQ_NIRQ2_PIN 40
+#endif
+
+struct irq_line
+{
+	uint32_t pin;
+	// Set by the GPIO interrupt, cleared when the main loop dispatches
+	volatile bool pending;
+	// Counter value at the first falling edge not yet dispatched
+	volatile uint64_t edge_ticks;
+};
+
+// MCU side of the RTC interrupts. The GPIO interrupt only timestamps the
+// falling edge of either RTC interrupt line and flags it, the SPI access and
+// callbacks run from the main loop through irq_service.
+struct irq
+{
+	struct rtc_interrupts *interrupts;
+	struct clock *clock;
+	struct irq_line lines[2];
+	// Edge to callback latency of the last dispatch and the worst one, in
+	// microseconds
+	uint32_t last_latency;
+	uint32_t max_latency;
+	uint32_t dispatches;
+};
+
+// Configure both pins as inputs interrupting on falling edges
+void irq_init(struct irq *irq, struct rtc_interrupts *interrupts, struct clock *clock);
+
+// Whether an RTC interrupt is waiting to be dispatched
+bool irq_pending(const struct irq *irq);
+
+// Read and clear the RTC status flags and run the registered callbacks, if an
+// interrupt line fired. Returns whether one did.
+bool irq_service(struct irq *irq);
+
+#endif//IRQ_H_
@@ -6,13 +6,430 @@
 
 #include <am1815.h>
 
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Range of registers mirrored by the shadow cache, the AM1815 control
+// registers [0x10, 0x40)
+#define RTC_CACHE_FIRST 0x10
+#define RTC_CACHE_END 0x40
+
+// Write-through shadow copy of the AM1815 control registers. Reads of cached
+// registers cost no SPI traffic, so read-modify-write bit updates cost a single
+// SPI write. Volatile status registers and the time registers are never
+// cached and always go to the RTC.
+struct rtc_cache
+{
+    struct am1815 *rtc;
+    uint8_t registers[RTC_CACHE_END - RTC_CACHE_FIRST];
+    // One bit per register in registers, set if the copy is up to date
+    uint64_t valid;
+    // Last value written to the configuration key register (0x1F), needed to
+    // know whether a write to a protected register was accepted
+    uint8_t key;
+};
+
+// Bind the cache to the RTC and fill it with one bulk read of the control
+// registers
+void rtc_cache_init(struct rtc_cache *cache, struct am1815 *rtc);
+
+// Read a register, from the cache when possible
+uint8_t rtc_cache_read(struct rtc_cache *cache, uint8_t addr);
+
+// Write a register through the cache
+void rtc_cache_write(struct rtc_cache *cache, uint8_t addr, uint8_t data);
+
+// Clear the bits in clear and then set the bits in set of a register. Costs a
+// single SPI write if the register is cached.
+void rtc_cache_update(struct rtc_cache *cache, uint8_t addr, uint8_t clear, uint8_t set);
+
+// Forget cached copies of registers that were changed behind the cache's back
+void rtc_cache_invalidate(struct rtc_cache *cache, uint8_t addr, size_t size);
+
+// Registers that can be staged in a transaction, [0x00, 0x40)
+#define RTC_TRANSACTION_END RTC_CACHE_END
+
+// Longest run of clean cached registers that a commit will rewrite with their
+// cached values to merge two bursts into one
+#define RTC_TRANSACTION_MAX_GAP 2
+
+// Set of register updates that is committed to the RTC in as few SPI bursts
+// as possible. Writes to adjacent registers are merged into one bulk write,
+// writes that would not change a cached register are dropped, and the
+// configuration key (0x1F) is written right before each protected register,
+// so callers never stage the key themselves.
+struct rtc_transaction
+{
+    struct rtc_cache *cache;
+    uint8_t registers[RTC_TRANSACTION_END];
+    // One bit per register in registers, set if it has a staged value
+    uint64_t dirty;
+};
+
+// Start an empty transaction against the cache
+void rtc_transaction_begin(struct rtc_transaction *tx, struct rtc_cache *cache);
+
+// Read a register as it will be after the transaction is committed
+uint8_t rtc_transaction_read(struct rtc_transaction *tx, uint8_t addr);
+
+// Stage a register write
+void rtc_transaction_write(struct rtc_transaction *tx, uint8_t addr, uint8_t data);
+
+// Stage clearing the bits in clear and then setting the bits in set
+void rtc_transaction_update(struct rtc_transaction *tx, uint8_t addr, uint8_t clear, uint8_t set);
+
+// Write all staged registers to the RTC and update the cache. Returns the
+// number of SPI bursts used.
+size_t rtc_transaction_commit(struct rtc_transaction *tx);
+
 // disable unused pins (i.e., all pins except SPI and VBAT)
-void disable_pins(struct am1815 *rtc);
+void disable_pins(struct rtc_cache *cache);
 
 // Set up registers that control the alarm
-void configure_alarm(struct am1815 *rtc, bool enable, uint8_t pulse);
+void configure_alarm(struct rtc_cache *cache, bool enable, uint8_t pulse);
 
 // Set up registers that control the countdown timer
-void configure_countdown(struct am1815 *rtc, double timer);
+void configure_countdown(struct rtc_cache *cache, double timer);
+
+// Unit of countdown timer periods, the timer's fastest clock
+#define RTC_TIMER_TICKS_PER_SECOND 4096
+
+// Longest countdown timer period, 256 minutes, in timer ticks
+#define RTC_TIMER_MAX_PERIOD (256u * 60 * RTC_TIMER_TICKS_PER_SECOND)
+
+// Where the countdown timer interrupt is output
+enum rtc_timer_output
+{
+    // Not routed to a pin, the Status register TIM flag still gets set
+    RTC_TIMER_OUTPUT_NONE,
+    // FOUT/nIRQ, as the combined nIRQ of all enabled interrupts. This replaces
+    // the nAIRQ selection the alarm setup and scheduler rely on.
+    RTC_TIMER_OUTPUT_NIRQ,
+    // PSW/nIRQ2, as nTIRQ
+    RTC_TIMER_OUTPUT_NIRQ2,
+};
+
+struct rtc_timer_config
+{
+    // Period in 1/RTC_TIMER_TICKS_PER_SECOND s, 0 disables the timer
+    uint32_t period;
+    // Reload and count down again at the end of each period (TRPT)
+    bool repeat;
+    // Pulsed instead of level interrupts (TM)
+    bool pulse;
+    enum rtc_timer_output output;
+};
+
+// Closest period the countdown timer can make to the one requested, both in
+// timer ticks, along with its clock selection (TFS) and count. The finest
+// clock that can count the whole period is used. Returns 0 if the period is 0
+// or too long.
+uint32_t rtc_timer_period(uint32_t period, uint8_t *tfs, uint16_t *count);
+
+// Program the countdown timer, its interrupt, and its output pin. Returns the
+// period actually programmed, in timer ticks, or 0 if the timer was disabled.
+uint32_t configure_periodic_timer(struct rtc_cache *cache, const struct rtc_timer_config *config);
+
+// XT oscillator calibration, as set in Cal_XT (0x14, CMDX and OFFSETX) and the
+// XTCAL field of Oscillator Status (0x1D). The adjustment is in steps of
+// 10^6 / 2^19 ppm (about 1.907 ppm); with CMDX set OFFSETX counts double steps
+// and XTCAL extends the range downwards.
+struct xt_calibration
+{
+    uint8_t xtcal;
+    bool cmdx;
+    int8_t offsetx;
+};
+
+// Range of adjustments the calibration registers can make, in ppb
+#define XT_CALIBRATION_MIN_PPB (-610352)
+#define XT_CALIBRATION_MAX_PPB 240326
+
+// Total frequency adjustment of a calibration, in parts per billion. Positive
+// values speed the clock up.
+int64_t xt_calibration_ppb(const struct xt_calibration *cal);
+
+// Closest calibration to an adjustment in parts per billion. Returns false if
+// the adjustment is out of range.
+bool xt_calibration_from_ppb(int64_t ppb, struct xt_calibration *cal);
+
+// Read the XT calibration currently in effect
+void read_xt_calibration(struct rtc_cache *cache, struct xt_calibration *cal);
+
+// Program the XT calibration registers
+void configure_xt_calibration(struct rtc_cache *cache, const struct xt_calibration *cal);
+
+// Autocalibration settings of the ACAL field of Oscillator Control (0x1C). While
+// enabled, the RC oscillator is calibrated against the XT oscillator
+// periodically, and once right away.
+#define RTC_ACAL_OFF 0
+#define RTC_ACAL_1024 2
+#define RTC_ACAL_512 3
+
+// RC oscillator calibration, the contents of Cal_RC_Hi (0x15) and Cal_RC_Low
+// (0x16)
+struct rc_calibration
+{
+    uint8_t hi;
+    uint8_t lo;
+};
+
+// Set the autocalibration period, clearing the autocalibration failure flag
+// when enabling it
+void configure_autocalibration(struct rtc_cache *cache, uint8_t acal);
+
+// Read the RC calibration left by autocalibration. Returns false if the last
+// autocalibration failed.
+bool read_rc_calibration(struct rtc_cache *cache, struct rc_calibration *cal);
+
+// Program the RC calibration registers
+void configure_rc_calibration(struct rtc_cache *cache, const struct rc_calibration *cal);
+
+// Mark the RTC as initialized by this program and apply the default alarm and
+// output configuration
+void initialize_rtc(struct rtc_cache *cache);
+
+// Part of the AM1815 user RAM holding the configuration image, [0x40, 0x60).
+// It is read along with the cached registers in one burst at boot.
+#define RTC_CONFIG_ADDR 0x40
+#define RTC_CONFIG_SIZE 0x20
+
+// Bump when the layout or the set of stored registers changes, so images
+// written by older firmware are ignored
+#define RTC_CONFIG_VERSION 2
+
+enum rtc_config_status
+{
+    // The registers already hold the stored configuration, nothing was written
+    RTC_CONFIG_MATCH,
+    // Some registers differed from the stored configuration and were rewritten
+    RTC_CONFIG_RESTORED,
+    // No valid image, left as is for provisioning
+    RTC_CONFIG_MISSING,
+};
+
+// Boot replacement for rtc_cache_init: fill the cache and fetch the
+// configuration image with one bulk read, then rewrite any register that
+// differs from a valid image. On a warm reset the check itself costs a single
+// SPI burst; the rest of the boot still anchors the clock, reads the event
+// log, and appends the boot record.
+enum rtc_config_status rtc_config_init(struct rtc_cache *cache, struct am1815 *rtc);
+
+// Store the current configuration in the image, versioned and protected by a
+// CRC16, with one SPI write
+void rtc_config_save(struct rtc_cache *cache);
+
+// Record in the tail of the configuration area, after the image, holding the
+// last RC calibration so it survives MCU resets
+#define RTC_RC_CALIBRATION_ADDR 0x5A
+
+// Store the RC calibration in user RAM, protected by a CRC16, with one SPI
+// write
+void rtc_rc_calibration_save(struct rtc_cache *cache, const struct rc_calibration *cal);
+
+// Fetch the stored RC calibration with one SPI read. Returns false if none was
+// stored.
+bool rtc_rc_calibration_load(struct rtc_cache *cache, struct rc_calibration *cal);
+
+// Most events the alarm scheduler can hold at once
+#define RTC_ALARM_MAX_EVENTS 16
+
+struct rtc_alarm_event
+{
+    // Rounded up to the RTC's hundredths resolution
+    struct timeval deadline;
+    void (*callback)(void *context);
+    void *context;
+};
+
+// Any number of timed events multiplexed onto the AM1815's single alarm. The
+// events are kept sorted by deadline, and the alarm registers (0x08-0x0E)
+// always hold the earliest one, set to match once a year (RPT = 1), so the
+// application can wait for many events without polling. Arming the alarm for
+// a new deadline takes one SPI burst, plus a read of the time to catch
+// deadlines that come before the alarm is written.
+struct rtc_alarm_scheduler
+{
+    struct rtc_cache *cache;
+    struct rtc_alarm_event events[RTC_ALARM_MAX_EVENTS];
+    size_t count;
+    // Deadline programmed in the alarm registers, if armed
+    struct timeval armed;
+    bool is_armed;
+};
+
+// Start a scheduler with no events. The alarm is left alone until the first
+// event is scheduled.
+void rtc_alarm_init(struct rtc_alarm_scheduler *scheduler, struct rtc_cache *cache);
+
+// Schedule a callback at an RTC time, re-arming the alarm if it is the new
+// earliest event. A deadline that has already come runs its callback before
+// this returns. Returns false if the scheduler is full.
+bool rtc_alarm_schedule(struct rtc_alarm_scheduler *scheduler, const struct timeval *deadline,
+    void (*callback)(void *context), void *context);
+
+// Remove all events with the given callback and context, returning how many
+// were removed
+size_t rtc_alarm_cancel(struct rtc_alarm_scheduler *scheduler,
+    void (*callback)(void *context), void *context);
+
+// Earliest pending deadline, or NULL if there are no events
+const struct timeval *rtc_alarm_next(const struct rtc_alarm_scheduler *scheduler);
+
+// Run the callbacks of all events due at now, the current RTC time, and arm
+// the alarm for the next one. Call this when the alarm fires. Callbacks may
+// schedule new events. Returns the number of callbacks run.
+size_t rtc_alarm_service(struct rtc_alarm_scheduler *scheduler, const struct timeval *now);
+
+// Interrupt flags of the Status register (0x0F)
+#define RTC_STATUS_EX1 0x01
+#define RTC_STATUS_EX2 0x02
+#define RTC_STATUS_ALM 0x04
+#define RTC_STATUS_TIM 0x08
+#define RTC_STATUS_BL 0x10
+#define RTC_STATUS_WDT 0x20
+#define RTC_STATUS_BAT 0x40
+
+// Most callbacks that can be registered for RTC interrupts
+#define RTC_INTERRUPT_MAX_HANDLERS 8
+
+struct rtc_interrupt_handler
+{
+    // Status flags the callback is run for
+    uint8_t flags;
+    // Called with all the status flags that were set
+    void (*callback)(void *context, uint8_t status);
+    void *context;
+};
+
+// Dispatch of the AM1815's interrupts to registered callbacks. Auto reset
+// (ARST) is enabled, so the one read of the Status register that finds out
+// which interrupts fired also clears them.
+struct rtc_interrupts
+{
+    struct rtc_cache *cache;
+    struct rtc_interrupt_handler handlers[RTC_INTERRUPT_MAX_HANDLERS];
+    size_t count;
+};
+
+// Start with no callbacks, and enable clearing the Status register on read
+void rtc_interrupts_init(struct rtc_interrupts *interrupts, struct rtc_cache *cache);
+
+// Register a callback for any of the given status flags. Returns false if
+// there is no room left.
+bool rtc_interrupts_register(struct rtc_interrupts *interrupts, uint8_t flags,
+    void (*callback)(void *context, uint8_t status), void *context);
+
+// Read and clear the Status register flags, in a single SPI read
+uint8_t rtc_interrupts_read(struct rtc_interrupts *interrupts);
+
+// Run the callbacks registered for any of the flags in status
+void rtc_interrupts_run(const struct rtc_interrupts *interrupts, uint8_t status);
+
+// Registers captured by a snapshot, the whole register map [0x00, 0x40)
+#define RTC_SNAPSHOT_SIZE 0x40
+
+// Copy of the register map from one bulk read, along with the previous one, so
+// changes can be reported without resending everything
+struct rtc_snapshot
+{
+    struct rtc_cache *cache;
+    uint8_t registers[RTC_SNAPSHOT_SIZE];
+    uint8_t previous[RTC_SNAPSHOT_SIZE];
+    // Whether previous holds an earlier snapshot
+    bool has_previous;
+};
+
+// Start with no snapshots taken
+void rtc_snapshot_init(struct rtc_snapshot *snapshot, struct rtc_cache *cache);
+
+// Read all registers in one burst, keeping the last snapshot as previous and
+// refreshing the cache. Returns one bit per register that changed since the
+// previous snapshot, all of them for the first one. The read clears the Status
+// register (0x0F) if auto reset is enabled, so pass registers[0x0F] on to
+// rtc_interrupts_run.
+uint64_t rtc_snapshot_take(struct rtc_snapshot *snapshot);
+
+// Part of the AM1815 user RAM holding the event log, [0x60, 0x100). The RAM
+// is kept on battery backup, so the log survives MCU resets and VCC loss.
+#define RTC_LOG_ADDR 0x60
+#define RTC_LOG_END 0x100
+
+// Log layout: magic (2), version (1), slot count (1), then the record slots
+#define RTC_LOG_HEADER 4
+#define RTC_LOG_VERSION 1
+
+// Records are seq (1), type (1), delta (2, BE), data (2, BE). The delta is the
+// time since the previous event in seconds, or RTC_LOG_NO_DELTA if it didn't
+// fit. Epoch records instead hold the absolute time in seconds (4, BE) of the
+// event after them in place of delta and data.
+#define RTC_LOG_RECORD_SIZE 6
+#define RTC_LOG_NO_DELTA 0xFFFF
+#define RTC_LOG_SLOTS ((RTC_LOG_END - RTC_LOG_ADDR - RTC_LOG_HEADER) / RTC_LOG_RECORD_SIZE)
+
+// The newest record is found after a reset as the one whose successor's seq
+// doesn't follow its own, which a full ring can only tell apart if its length
+// isn't a multiple of the seq modulus
+_Static_assert(RTC_LOG_SLOTS % 256 != 0, "log slot count is a multiple of the seq modulus");
+
+enum rtc_log_type
+{
+    RTC_LOG_EMPTY,
+    // Absolute time of the event after it
+    RTC_LOG_EPOCH,
+    // Firmware started, data is Oscillator Status (0x1D), whose OF bit tells
+    // of an oscillator failure and OMODE of running on the RC oscillator
+    RTC_LOG_BOOT,
+    // Time set outright
+    RTC_LOG_TIME_SET,
+    // Time stepped by an offset, data is the offset in ms
+    RTC_LOG_TIME_STEP,
+    // XT calibration changed, data is the adjustment in 0.1 ppm
+    RTC_LOG_CALIBRATION,
+    // Power switched between VCC and battery, data is the Status register
+    RTC_LOG_POWER,
+};
+
+struct rtc_log_record
+{
+    uint8_t seq;
+    uint8_t type;
+    // Unknown for events cut off from every surviving epoch by a missing delta
+    bool time_known;
+    int64_t time;
+    int16_t data;
+};
+
+// Ring buffer of fixed size records. Appends are a single SPI burst, except
+// when the records wrap around the end of the RAM.
+struct rtc_log
+{
+    struct rtc_cache *cache;
+    // Slot the next record goes in, and its seq
+    size_t next;
+    uint8_t seq;
+    size_t count;
+    // Time of the newest record, if there is one with a known time
+    int64_t last;
+    bool has_last;
+    // Events since the newest epoch record
+    size_t since_epoch;
+};
+
+// Find the end of the log with one bulk read, formatting the log RAM if it
+// doesn't hold a log
+void rtc_log_init(struct rtc_log *log, struct rtc_cache *cache);
+
+// Add a record at now. An epoch record goes first when the time since the
+// previous record doesn't fit in a delta or went backwards, or when the ring
+// would otherwise lose its only epoch.
+void rtc_log_append(struct rtc_log *log, const struct timeval *now, uint8_t type, int16_t data);
+
+// Read the whole log with one bulk read into records, oldest first. records
+// must have room for RTC_LOG_SLOTS. Returns the number of records.
+size_t rtc_log_read(struct rtc_log *log, struct rtc_log_record *records);
 
 #endif//RTC_H_
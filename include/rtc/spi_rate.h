@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#ifndef SPI_RATE_H_
+#define SPI_RATE_H_
+
+#include <clock.h>
+
+#include <am1815.h>
+#include <spi.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Clock the RTC SPI device starts at, the AM1815's rated maximum
+#define SPI_RATE_SAFE 2000000u
+
+// Fastest clock the self-test may select, set with the spi_rate_max meson
+// option. The AM1815 datasheet rates its SPI interface to 2 MHz, raise this
+// only for parts and boards characterized faster.
+#ifndef SPI_RATE_MAX
+#define SPI_RATE_MAX 2000000u
+#endif
+
+// Candidate bus clocks, slowest first. Those below SPI_RATE_SAFE are
+// fallbacks for links that fail at it, those above SPI_RATE_MAX are skipped.
+#define SPI_RATE_COUNT 8
+extern const uint32_t spi_rates[SPI_RATE_COUNT];
+
+// Passes over the test at each clock, all of which have to be clean for the
+// clock to count as passing with margin
+#define SPI_RATE_ROUNDS 4
+
+struct spi_rate_result
+{
+	uint32_t hz;
+	// Whether the clock was in range and reached by the test
+	bool tested;
+	// Bytes read back wrong, over all rounds
+	uint32_t errors;
+	// Mean time of a bulk read of the test region, in nanoseconds
+	uint32_t bulk_ns;
+};
+
+// Link self-test of the RTC SPI bus. The AM1815 user RAM [0x40, 0x100) is
+// saved at the slowest candidate clock. Each candidate, slowest first, is
+// first checked with reads only, of the saved RAM and the ID registers, so a
+// garbled address can't write anything. Only if those are clean are patterns
+// written to the user RAM and read back. A failing readback is never followed
+// by a write at that clock: the RAM is restored at the fastest clock that
+// passed, so the config image and event log survive. The fastest clock that
+// passed every round, with every slower candidate passing too, is selected
+// and the device is left at it. Returns the selected clock, or 0 if even the
+// slowest candidate failed, in which case the device is left at the safe
+// clock. results gets SPI_RATE_COUNT entries.
+uint32_t spi_rate_select(struct spi_bus *bus, struct spi_device **device, struct am1815 *rtc,
+	struct clock *clock, struct spi_rate_result *results);
+
+#endif//SPI_RATE_H_
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Cycle counts of hot paths, taken with the Cortex-M4 DWT cycle counter and
+// kept as histograms with one bucket per power of two, so recording costs a
+// few cycles and no memory beyond the fixed buckets. Without RTC_STATS
+// (meson -Dstats=false) the probes compile to nothing. The counter wraps after
+// 2^32 cycles, about 89 s at 48 MHz, so longer spans are not measured right.
+
+#ifdef RTC_STATS
+#include "am_mcu_apollo.h"
+#endif
+
+#define STATS_BUCKETS 32
+
+struct stats_probe
+{
+	uint32_t count;
+#ifdef RTC_STATS
+	uint32_t min;
+	uint32_t max;
+	// Bucket i counts spans of [2^i, 2^(i+1)) cycles, bucket 0 also 0
+	uint32_t buckets[STATS_BUCKETS];
+#endif
+};
+
+// Probes outside of the command handlers. Only these SPI accesses are timed
+// on their own; other register and bulk traffic (cache writes, transaction
+// commits, log appends, snapshots, alarm arming) only counts toward the
+// command that caused it.
+enum stats_probe_id
+{
+	STATS_READ_TIME,
+	STATS_WRITE_TIME,
+	STATS_STATUS_READ,
+	STATS_UART_WRITE,
+	STATS_PROBES,
+};
+
+extern struct stats_probe stats_probes[STATS_PROBES];
+extern const char *const stats_probe_names[STATS_PROBES];
+
+struct stats_summary
+{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	// Upper bounds of the power of two buckets, so up to twice the real
+	// value, clamped to the min and max
+	uint32_t p50;
+	uint32_t p99;
+};
+
+#ifdef RTC_STATS
+
+// Start the cycle counter
+void stats_init(void);
+
+static inline uint32_t stats_start(void)
+{
+	return DWT->CYCCNT;
+}
+
+// Record the cycles since start, a value from stats_start
+void stats_record(struct stats_probe *probe, uint32_t start);
+
+// Summarize a probe. Returns false if it recorded nothing.
+bool stats_summarize(const struct stats_probe *probe, struct stats_summary *summary);
+
+void stats_reset(struct stats_probe *probe);
+
+#else
+
+static inline void stats_init(void)
+{
+}
+
+static inline uint32_t stats_start(void)
+{
+	return 0;
+}
+
+static inline void stats_record(struct stats_probe *probe, uint32_t start)
+{
+	(void)probe;
+	(void)start;
+}
+
+static inline bool stats_summarize(const struct stats_probe *probe, struct stats_summary *summary)
+{
+	(void)probe;
+	(void)summary;
+	return false;
+}
+
+static inline void stats_reset(struct stats_probe *probe)
+{
+	(void)probe;
+}
+
+#endif
+
+#endif//STATS_H_
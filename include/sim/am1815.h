@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#ifndef AM1815_H_
+#define AM1815_H_
+
+// Host replacement for the asimple AM1815 driver. It exposes the same calls as
+// the real driver, but backs them with an in-memory register model that keeps
+// time and counts SPI traffic, so librtc can be built and measured without a
+// board attached.
+
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct spi_device;
+
+struct am1815
+{
+	struct spi_device *spi;
+};
+
+// SPI traffic counters kept by the model. A transaction is one chip-select
+// cycle, which is what the real hardware pays the most for.
+struct am1815_sim_stats
+{
+	uint64_t transactions;
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	// Writes to key-protected registers without the right key, dropped just
+	// like the hardware does
+	uint64_t rejected_writes;
+};
+
+void am1815_init(struct am1815 *rtc, struct spi_device *device);
+
+uint8_t am1815_read_register(struct am1815 *rtc, uint8_t addr);
+
+void am1815_read_bulk(struct am1815 *rtc, uint8_t addr, uint8_t *data, size_t size);
+
+void am1815_write_register(struct am1815 *rtc, uint8_t addr, uint8_t data);
+
+void am1815_write_bulk(struct am1815 *rtc, uint8_t addr, const uint8_t *data, size_t size);
+
+struct timeval am1815_read_time(struct am1815 *rtc);
+
+void am1815_write_time(struct am1815 *rtc, const struct timeval *time);
+
+double am1815_write_timer(struct am1815 *rtc, double timer);
+
+void am1815_enable_trickle(struct am1815 *rtc);
+
+void am1815_disable_trickle(struct am1815 *rtc);
+
+// Simulation control. These do not exist in the real driver.
+
+// Restore every register to its power-on default and zero the counters
+void am1815_sim_reset(void);
+
+// Copy out the current SPI counters
+struct am1815_sim_stats am1815_sim_get_stats(void);
+
+// Zero the SPI counters, leaving register state alone
+void am1815_sim_clear_stats(void);
+
+// Peek at a register without generating SPI traffic
+uint8_t am1815_sim_peek(uint8_t addr);
+
+#endif//AM1815_H_
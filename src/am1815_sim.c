@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+// Software model of the AM1815 register file, used for host builds. Only the
+// behavior librtc depends on is modeled: the BCD time registers keep running
+// off the host's monotonic clock, the configuration key (0x1F) gates writes to
+// protected registers, and every access is counted as SPI traffic.
+
+#include <am1815.h>
+
+#include <time.h>
+#include <string.h>
+#include <math.h>
+
+#define AM1815_REGISTERS 256
+
+static uint8_t registers[AM1815_REGISTERS];
+static struct am1815_sim_stats stats;
+
+// The time registers are derived from these: the RTC time that was last
+// written, and the host monotonic time at which it was written
+static struct timeval epoch;
+static struct timespec epoch_host;
+
+// Power-on defaults for the registers librtc touches, per the AM18x5 datasheet
+static const struct
+{
+	uint8_t addr;
+	uint8_t value;
+} defaults[] = {
+	{ 0x10, 0x13 }, // Control1
+	{ 0x11, 0x3C }, // Control2
+	{ 0x12, 0xE0 }, // Interrupt Mask
+	{ 0x13, 0x26 }, // SQW
+	{ 0x18, 0x23 }, // Countdown Timer Control
+	{ 0x21, 0xF0 }, // BREF Control
+	{ 0x27, 0x80 }, // Batmode IO
+	{ 0x28, 0x18 }, // ID0
+	{ 0x29, 0x15 }, // ID1
+};
+
+static uint8_t to_bcd(unsigned value)
+{
+	return (uint8_t)(((value / 10) << 4) | (value % 10));
+}
+
+static unsigned from_bcd(uint8_t value)
+{
+	return (value >> 4) * 10 + (value & 0x0F);
+}
+
+static struct timeval now(void)
+{
+	struct timespec host;
+	clock_gettime(CLOCK_MONOTONIC, &host);
+	int64_t elapsed_us = (host.tv_sec - epoch_host.tv_sec) * 1000000ll +
+		(host.tv_nsec - epoch_host.tv_nsec) / 1000;
+	int64_t us = epoch.tv_usec + elapsed_us;
+	struct timeval result = {
+		.tv_sec = epoch.tv_sec + us / 1000000,
+		.tv_usec = us % 1000000,
+	};
+	return result;
+}
+
+static void set_now(const struct timeval *time)
+{
+	epoch = *time;
+	// The RTC only resolves hundredths
+	epoch.tv_usec -= epoch.tv_usec % 10000;
+	clock_gettime(CLOCK_MONOTONIC, &epoch_host);
+}
+
+// Refresh registers 0x00-0x07 from the running clock
+static void materialize_time(void)
+{
+	struct timeval current = now();
+	time_t seconds = current.tv_sec;
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	registers[0x00] = to_bcd(current.tv_usec / 10000);
+	// Bit 7 of the seconds register is a general purpose bit, keep it
+	registers[0x01] = (registers[0x01] & 0x80) | to_bcd(tm.tm_sec);
+	registers[0x02] = to_bcd(tm.tm_min);
+	registers[0x03] = to_bcd(tm.tm_hour);
+	registers[0x04] = to_bcd(tm.tm_mday);
+	registers[0x05] = to_bcd(tm.tm_mon + 1);
+	registers[0x06] = to_bcd(tm.tm_year - 100);
+	registers[0x07] = tm.tm_wday;
+}
+
+// Restart the clock from whatever is in registers 0x00-0x07
+static void latch_time(void)
+{
+	struct tm tm = {
+		.tm_sec = from_bcd(registers[0x01] & 0x7F),
+		.tm_min = from_bcd(registers[0x02] & 0x7F),
+		.tm_hour = from_bcd(registers[0x03] & 0x3F),
+		.tm_mday = from_bcd(registers[0x04] & 0x3F),
+		.tm_mon = from_bcd(registers[0x05] & 0x1F) - 1,
+		.tm_year = from_bcd(registers[0x06]) + 100,
+	};
+	struct timeval time = {
+		.tv_sec = timegm(&tm),
+		.tv_usec = from_bcd(registers[0x00]) * 10000,
+	};
+	set_now(&time);
+}
+
+static bool is_time_register(uint8_t addr)
+{
+	return addr <= 0x07;
+}
+
+// Key value needed to write the given register, or 0 if it isn't protected
+static uint8_t required_key(uint8_t addr)
+{
+	switch (addr)
+	{
+	case 0x1C:
+		return 0xA1;
+	case 0x20:
+	case 0x21:
+	case 0x26:
+	case 0x27:
+	case 0x30:
+		return 0x9D;
+	default:
+		return 0;
+	}
+}
+
+static bool is_read_only(uint8_t addr)
+{
+	// ID registers and analog status
+	return addr >= 0x28 && addr <= 0x2F;
+}
+
+static uint8_t read_one(uint8_t addr)
+{
+	// The key register always reads back as zero
+	if (addr == 0x1F)
+		return 0;
+	return registers[addr];
+}
+
+static void write_one(uint8_t addr, uint8_t data)
+{
+	if (is_read_only(addr))
+		return;
+
+	uint8_t key = required_key(addr);
+	if (key)
+	{
+		if (registers[0x1F] != key)
+		{
+			++stats.rejected_writes;
+			return;
+		}
+		// The key is consumed by the protected write
+		registers[0x1F] = 0;
+	}
+	registers[addr] = data;
+}
+
+void am1815_init(struct am1815 *rtc, struct spi_device *device)
+{
+	rtc->spi = device;
+}
+
+void am1815_read_bulk(struct am1815 *rtc, uint8_t addr, uint8_t *data, size_t size)
+{
+	(void)rtc;
+	if (is_time_register(addr))
+		materialize_time();
+	for (size_t i = 0; i < size; ++i)
+		data[i] = read_one((uint8_t)(addr + i));
+
+	++stats.transactions;
+	++stats.reads;
+	stats.bytes_read += size;
+}
+
+uint8_t am1815_read_register(struct am1815 *rtc, uint8_t addr)
+{
+	uint8_t result;
+	am1815_read_bulk(rtc, addr, &result, 1);
+	return result;
+}
+
+void am1815_write_bulk(struct am1815 *rtc, uint8_t addr, const uint8_t *data, size_t size)
+{
+	(void)rtc;
+	bool touches_time = is_time_register(addr);
+	if (touches_time)
+		materialize_time();
+	for (size_t i = 0; i < size; ++i)
+		write_one((uint8_t)(addr + i), data[i]);
+	if (touches_time)
+		latch_time();
+
+	++stats.transactions;
+	++stats.writes;
+	stats.bytes_written += size;
+}
+
+void am1815_write_register(struct am1815 *rtc, uint8_t addr, uint8_t data)
+{
+	am1815_write_bulk(rtc, addr, &data, 1);
+}
+
+struct timeval am1815_read_time(struct am1815 *rtc)
+{
+	uint8_t time[8];
+	am1815_read_bulk(rtc, 0x00, time, sizeof(time));
+	struct tm tm = {
+		.tm_sec = from_bcd(time[1] & 0x7F),
+		.tm_min = from_bcd(time[2] & 0x7F),
+		.tm_hour = from_bcd(time[3] & 0x3F),
+		.tm_mday = from_bcd(time[4] & 0x3F),
+		.tm_mon = from_bcd(time[5] & 0x1F) - 1,
+		.tm_year = from_bcd(time[6]) + 100,
+	};
+	struct timeval result = {
+		.tv_sec = timegm(&tm),
+		.tv_usec = from_bcd(time[0]) * 10000,
+	};
+	return result;
+}
+
+void am1815_write_time(struct am1815 *rtc, const struct timeval *time)
+{
+	time_t seconds = time->tv_sec;
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	uint8_t data[8] = {
+		to_bcd(time->tv_usec / 10000),
+		(registers[0x01] & 0x80) | to_bcd(tm.tm_sec),
+		to_bcd(tm.tm_min),
+		to_bcd(tm.tm_hour),
+		to_bcd(tm.tm_mday),
+		to_bcd(tm.tm_mon + 1),
+		to_bcd(tm.tm_year - 100),
+		tm.tm_wday,
+	};
+	am1815_write_bulk(rtc, 0x00, data, sizeof(data));
+}
+
+double am1815_write_timer(struct am1815 *rtc, double timer)
+{
+	// Timer frequencies selectable through TFS, fastest first
+	static const double frequencies[] = { 4096., 64., 1., 1./60. };
+
+	uint8_t control = am1815_read_register(rtc, 0x18);
+	for (size_t i = 0; i < sizeof(frequencies)/sizeof(*frequencies); ++i)
+	{
+		double count = round(timer * frequencies[i]);
+		if (count > 256.)
+			continue;
+		if (count < 1.)
+			return 0.;
+		uint8_t data[3] = {
+			(control & ~0b10000011) | 0b10000000 | (uint8_t)i,
+			(uint8_t)(count - 1),
+			(uint8_t)(count - 1),
+		};
+		am1815_write_bulk(rtc, 0x18, data, sizeof(data));
+		return count / frequencies[i];
+	}
+	return 0.;
+}
+
+void am1815_enable_trickle(struct am1815 *rtc)
+{
+	am1815_write_register(rtc, 0x1F, 0x9D);
+	// TCS = 0b1010 (enable), schottky diode, 3k output resistor
+	am1815_write_register(rtc, 0x20, 0xA5);
+}
+
+void am1815_disable_trickle(struct am1815 *rtc)
+{
+	am1815_write_register(rtc, 0x1F, 0x9D);
+	am1815_write_register(rtc, 0x20, 0x00);
+}
+
+void am1815_sim_reset(void)
+{
+	memset(registers, 0, sizeof(registers));
+	for (size_t i = 0; i < sizeof(defaults)/sizeof(*defaults); ++i)
+		registers[defaults[i].addr] = defaults[i].value;
+	struct timeval zero = { .tv_sec = 946684800 }; // 2000-01-01
+	set_now(&zero);
+	am1815_sim_clear_stats();
+}
+
+struct am1815_sim_stats am1815_sim_get_stats(void)
+{
+	return stats;
+}
+
+void am1815_sim_clear_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+uint8_t am1815_sim_peek(uint8_t addr)
+{
+	if (is_time_register(addr))
+		materialize_time();
+	return registers[addr];
+}
@@ -0,0 +1,75 @@
+# SPDX-License-Identifier: Apache-2.0
+# SPDX-FileCopyrightText 2023 Gabriel Marcano
+
+"""
+Collects the results of the on-target benchmark firmware (redboard_rtc_bench,
+built from test-time.c). It echoes bytes back for the UART round trip
+benchmark, parses the `name key=value ...` result lines, and appends them as
+one JSON object per run to a history file, tagged with a label such as the
+release, so performance can be compared release over release. Reset the board
+after starting this script.
+"""
+
+import argparse
+import json
+import time
+import serial
+
+def parse_result(line):
+    """
+    Splits a result line into its name and its integer fields
+    """
+    name, *fields = line.split()
+    values = {}
+    for field in fields:
+        key, _, value = field.partition('=')
+        values[key] = int(value)
+    return name, values
+
+def run(ser):
+    results = {}
+    while True:
+        line = ser.readline().decode('utf-8', errors='replace').strip()
+        if not line:
+            continue
+        if line == "uart_ready":
+            # Echo every byte until the results line after the exchange
+            line = b""
+            while True:
+                byte = ser.read(1)
+                if byte == b'!':
+                    ser.write(byte)
+                elif byte not in (b'\r', b'\n'):
+                    line += byte
+                elif line:
+                    break
+            line = line.decode('utf-8')
+        if line == "bench done":
+            return results
+        if line.startswith("bench"):
+            continue
+        name, values = parse_result(line)
+        results[name] = values
+        print(line)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("port", nargs='?', default="/dev/ttyUSB0",
+        help="serial port of the RedBoard")
+    parser.add_argument("--label", default="",
+        help="tag for this run, e.g. the firmware release")
+    parser.add_argument("--history", default="bench_history.jsonl",
+        help="file each run's results are appended to")
+    args = parser.parse_args()
+
+    ser = serial.Serial(args.port)
+    ser.baudrate = 115200
+    ser.reset_input_buffer()
+
+    results = run(ser)
+    with open(args.history, 'a') as history:
+        history.write(json.dumps({"time": time.time(), "label": args.label,
+            "results": results}) + "\n")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+# SPDX-License-Identifier: Apache-2.0
+# SPDX-FileCopyrightText 2023 Gabriel Marcano
+
+"""
+Host side of the binary framed protocol (see include/rtc/frame.h). Frames are
+laid out like SVL bootloader packets and use the same CRC16 as svl.py.
+"""
+
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from svl import get_crc16
+
+GET_TIME = 0x01
+SET_TIME = 0x02
+CHANGE_TIME = 0x03
+PING = 0x04
+PING_REQUEST = 0x05
+PING_RESPONSE = 0x06
+READ = 0x07
+WRITE = 0x08
+EXIT = 0x7F
+ERROR = 0xFF
+RESPONSE = 0x80
+
+class FrameError(Exception):
+    pass
+
+def encode_frame(opcode, payload=b''):
+    body = bytes([opcode]) + bytes(payload)
+    crc = get_crc16(body)
+    length = len(body) + 2
+    return length.to_bytes(2, 'big') + body + crc.to_bytes(2, 'big')
+
+def read_frame(ser):
+    """Read one frame, returning (opcode, payload)"""
+    header = ser.read(2)
+    if len(header) < 2:
+        raise FrameError("timeout waiting for frame")
+    length = int.from_bytes(header, 'big')
+    body = ser.read(length)
+    if len(body) != length:
+        raise FrameError("timeout in frame body")
+    if get_crc16(body) != 0:
+        raise FrameError("bad CRC")
+    opcode = body[0]
+    payload = body[1:-2]
+    if opcode == ERROR:
+        raise FrameError(f"device error {payload[0]}")
+    return opcode, payload
+
+def _timeval(payload, offset=0):
+    seconds, microseconds = struct.unpack_from('>QI', payload, offset)
+    return seconds + microseconds / 1000000
+
+class BinaryLink:
+    """Binary protocol session over an open serial port"""
+
+    def __init__(self, ser):
+        self.ser = ser
+
+    def __enter__(self):
+        self.ser.reset_input_buffer()
+        self.ser.write(b"binary\r\n")
+        line = self.ser.readline()
+        while line.strip() != b"binary mode":
+            if not line:
+                raise FrameError("device did not enter binary mode")
+            line = self.ser.readline()
+        return self
+
+    def __exit__(self, *args):
+        self.transact(EXIT)
+
+    def transact(self, opcode, payload=b''):
+        self.ser.write(encode_frame(opcode, payload))
+        response, data = read_frame(self.ser)
+        if response != opcode | RESPONSE:
+            raise FrameError(f"unexpected response {response:#x}")
+        return data
+
+    def get_time(self):
+        return _timeval(self.transact(GET_TIME))
+
+    def set_time(self, seconds, hundredths):
+        self.transact(SET_TIME, struct.pack('>QB', seconds, hundredths))
+
+    def change_time(self, offset):
+        """Shift the RTC by offset seconds, returns the new RTC time"""
+        data = self.transact(CHANGE_TIME, struct.pack('>q', round(offset * 1000000)))
+        return _timeval(data)
+
+    def ping(self, clock):
+        """
+        Run one ping exchange, returning (t0, t1, t2, t3), where t0 and t3 are
+        the device's request and response times and t1 and t2 are clock()
+        taken when the request arrived and the response was sent.
+        """
+        self.ser.write(encode_frame(PING))
+        opcode, _ = read_frame(self.ser)
+        t1 = clock()
+        if opcode != PING_REQUEST:
+            raise FrameError(f"unexpected frame {opcode:#x}")
+        self.ser.write(encode_frame(PING_RESPONSE))
+        t2 = clock()
+        opcode, data = read_frame(self.ser)
+        if opcode != PING | RESPONSE:
+            raise FrameError(f"unexpected response {opcode:#x}")
+        return _timeval(data, 0), t1, t2, _timeval(data, 12)
+
+    def read(self, addr, size):
+        return self.transact(READ, bytes([addr, size]))
+
+    def write(self, addr, data):
+        self.transact(WRITE, bytes([addr]) + bytes(data))
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#include <clock.h>
+#include <stats.h>
+
+#include <am1815.h>
+
+#include "am_mcu_apollo.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Clock kept up to date by the counter overflow interrupt
+static struct clock *overflow_clock;
+
+void am_stimer_isr(void)
+{
+	am_hal_stimer_int_clear(AM_HAL_STIMER_INT_OVERFLOW);
+	// Reading the counter right after it wraps is all the extension needs
+	if (overflow_clock)
+		clock_ticks(overflow_clock);
+}
+
+void clock_init(struct clock *clock, struct am1815 *rtc)
+{
+	clock->rtc = rtc;
+	clock->rate = CLOCK_TICKS_PER_SECOND;
+	clock->anchor_ticks = 0;
+	clock->last_count = 0;
+	clock->high = 0;
+	clock->write_ticks = 0;
+
+	am_hal_stimer_config(AM_HAL_STIMER_CFG_CLEAR | AM_HAL_STIMER_CFG_FREEZE);
+	am_hal_stimer_config(AM_HAL_STIMER_HFRC_3MHZ);
+
+	// Without the overflow interrupt the 64-bit extension would be lost if
+	// nothing read the counter for a whole wrap (about 23 minutes)
+	overflow_clock = clock;
+	am_hal_stimer_int_clear(AM_HAL_STIMER_INT_OVERFLOW);
+	am_hal_stimer_int_enable(AM_HAL_STIMER_INT_OVERFLOW);
+	NVIC_EnableIRQ(STIMER_IRQn);
+
+	clock_anchor(clock);
+
+	// Otherwise the first timed write would start late by the whole write
+	uint64_t start = clock_ticks(clock);
+	am1815_read_time(rtc);
+	clock->write_ticks = clock_ticks(clock) - start;
+}
+
+static unsigned from_bcd(uint8_t value)
+{
+	return (value >> 4) * 10 + (value & 0x0F);
+}
+
+static int64_t timeval_diff_us(const struct timeval *end, const struct timeval *start)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000000 + (end->tv_usec - start->tv_usec);
+}
+
+struct timeval timeval_add_us(struct timeval time, int64_t offset)
+{
+	int64_t seconds = time.tv_sec + offset / 1000000;
+	int64_t microseconds = time.tv_usec + offset % 1000000;
+	if (microseconds >= 1000000)
+	{
+		microseconds -= 1000000;
+		seconds += 1;
+	}
+	else if (microseconds < 0)
+	{
+		microseconds += 1000000;
+		seconds -= 1;
+	}
+	struct timeval result = {.tv_sec = seconds, .tv_usec = microseconds};
+	return result;
+}
+
+// Poll the hundredths register until it differs from start, which was read at
+// counter value previous. The rollover happened between the samples of the
+// last two reads, each taken as the midpoint of its read. Returns the counter
+// value at the rollover.
+static uint64_t wait_rollover(struct clock *clock, uint8_t start, uint64_t previous, uint8_t *hundredths)
+{
+	for (;;)
+	{
+		uint64_t before = clock_ticks(clock);
+		uint8_t value = am1815_read_register(clock->rtc, 0x00);
+		uint64_t current = (before + clock_ticks(clock)) / 2;
+		if (value != start)
+		{
+			*hundredths = value;
+			return (previous + current) / 2;
+		}
+		previous = current;
+	}
+}
+
+void clock_anchor(struct clock *clock)
+{
+	struct timeval time;
+	uint64_t ticks;
+	for (;;)
+	{
+		uint64_t before = clock_ticks(clock);
+		uint8_t start = am1815_read_register(clock->rtc, 0x00);
+		uint64_t previous = (before + clock_ticks(clock)) / 2;
+		uint8_t hundredths;
+		ticks = wait_rollover(clock, start, previous, &hundredths);
+
+		// At the rollover the sub-hundredth part of the time is exactly zero.
+		// If the time read somehow landed on a later hundredth, try again.
+		uint32_t start_cycles = stats_start();
+		time = am1815_read_time(clock->rtc);
+		stats_record(&stats_probes[STATS_READ_TIME], start_cycles);
+		if ((unsigned)(time.tv_usec / 10000) == from_bcd(hundredths))
+			break;
+	}
+
+	// Measure the counter against the RTC since the previous anchor
+	if (clock->anchor_ticks)
+	{
+		int64_t elapsed_us = timeval_diff_us(&time, &clock->anchor_time);
+		if (elapsed_us >= CLOCK_RATE_MIN_INTERVAL * 1000000ll)
+		{
+			uint64_t rate = (ticks - clock->anchor_ticks) * 1000000 / elapsed_us;
+			// Ignore nonsense, e.g. if the RTC was set since the last anchor
+			if (rate > CLOCK_TICKS_PER_SECOND / 100 * 95 && rate < CLOCK_TICKS_PER_SECOND / 100 * 105)
+				clock->rate = rate;
+		}
+	}
+
+	clock->anchor_time = time;
+	clock->anchor_ticks = ticks;
+}
+
+bool clock_adjust(struct clock *clock, int64_t offset, struct clock_adjustment *result)
+{
+	// The RTC only takes whole hundredths, round to the nearest one
+	int64_t applied = (offset >= 0 ? offset + 5000 : offset - 5000) / 10000 * 10000;
+	uint64_t max_window = (uint64_t)CLOCK_ADJUST_MAX_WINDOW * clock->rate / 1000000;
+
+	for (unsigned attempt = 0; attempt < CLOCK_ADJUST_ATTEMPTS; ++attempt)
+	{
+		// The read tells which hundredth is current, the rollover out of it is
+		// then exactly one hundredth later. If polling missed a hundredth the
+		// reference is unknown, so start over.
+		uint64_t read_start = clock_ticks(clock);
+		uint32_t start_cycles = stats_start();
+		struct timeval before = am1815_read_time(clock->rtc);
+		stats_record(&stats_probes[STATS_READ_TIME], start_cycles);
+		uint64_t previous = (read_start + clock_ticks(clock)) / 2;
+		unsigned current = before.tv_usec / 10000;
+		uint8_t hundredths;
+		uint64_t rollover = wait_rollover(clock, (current / 10) << 4 | current % 10, previous, &hundredths);
+		if (from_bcd(hundredths) != (current + 1) % 100)
+			continue;
+
+		before.tv_usec = current * 10000;
+		struct timeval target = timeval_add_us(before, 10000 + applied);
+
+		// Only write if the write is certain to end before the next rollover,
+		// otherwise the target would be a hundredth stale
+		uint64_t write_start = clock_ticks(clock);
+		if (write_start - rollover + clock->write_ticks > max_window)
+			continue;
+		start_cycles = stats_start();
+		am1815_write_time(clock->rtc, &target);
+		uint64_t write_end = clock_ticks(clock);
+		stats_record(&stats_probes[STATS_WRITE_TIME], start_cycles);
+		clock->write_ticks = write_end - write_start;
+
+		result->applied = applied;
+		result->window = (write_end - rollover) * 1000000 / clock->rate;
+		result->attempts = attempt + 1;
+		clock_resync(clock);
+		return true;
+	}
+	return false;
+}
+
+void clock_resync(struct clock *clock)
+{
+	clock->anchor_ticks = 0;
+	clock_anchor(clock);
+}
+
+void clock_service(struct clock *clock)
+{
+	uint64_t age = clock_ticks(clock) - clock->anchor_ticks;
+	if (age > (uint64_t)CLOCK_ANCHOR_INTERVAL * clock->rate)
+		clock_anchor(clock);
+}
+
+uint64_t clock_ticks(struct clock *clock)
+{
+	// Timestamps are also taken from interrupt handlers, keep the extension
+	// consistent
+	uint32_t state = am_hal_interrupt_master_disable();
+	uint32_t count = am_hal_stimer_counter_get();
+	if (count < clock->last_count)
+		clock->high += 1ull << 32;
+	clock->last_count = count;
+	uint64_t ticks = clock->high | count;
+	am_hal_interrupt_master_set(state);
+	return ticks;
+}
+
+struct timeval clock_ticks_to_time(const struct clock *clock, uint64_t ticks)
+{
+	int64_t elapsed = (int64_t)(ticks - clock->anchor_ticks);
+	int64_t microseconds = clock->anchor_time.tv_usec +
+		elapsed * 1000000 / (int64_t)clock->rate;
+
+	// Normalize, elapsed may be negative for events before the anchor
+	int64_t seconds = microseconds / 1000000;
+	microseconds %= 1000000;
+	if (microseconds < 0)
+	{
+		microseconds += 1000000;
+		seconds -= 1;
+	}
+	struct timeval result = {
+		.tv_sec = clock->anchor_time.tv_sec + seconds,
+		.tv_usec = microseconds,
+	};
+	return result;
+}
+
+struct timeval clock_now(struct clock *clock)
+{
+	return clock_ticks_to_time(clock, clock_ticks(clock));
+}
@@ -1,3 +1,4 @@
+import math
 import time
 import serial
 
@@ -8,6 +9,14 @@ write program on server to call redboard_rtc commands to do time sync
 INTERVAL = 0.05  # in seconds
 DELAY = 0.05  # in seconds
 
+# How far ahead of now a scheduled set_time targets, to leave room for the
+# command and handshake to go through
+LEAD = 0.2  # in seconds
+# Time for the device to receive one byte at 115200 baud, 8N1
+BYTE_TIME = 10 / 115200  # in seconds
+# Host serial stack latency, e.g. the FTDI latency timer
+LATENCY = 0.001  # in seconds
+
 def constant_time(port, ser):
     startTime = time.monotonic()
     endTime = startTime + INTERVAL
@@ -23,4 +32,38 @@ def constant_time(port, ser):
         time.sleep(DELAY)
         now = time.monotonic()
 
-# constant_time("/dev/ttyUSB1")
\ No newline at end of file
+def scheduled_time(ser, latency=LATENCY):
+    """
+    Set the RTC with a single set_time_at command. The device is told the
+    target time up front, and then how long after the arrival of the next line
+    to write it, so UART and parsing latency don't end up in the RTC's time.
+    Returns the residual the device reported, in microseconds.
+    """
+    ser.reset_input_buffer()
+
+    # Aim at the next hundredths boundary at least LEAD from now
+    target = math.ceil((time.time() + LEAD) * 100) / 100
+    seconds = int(target)
+    hundredths = round((target - seconds) * 100)
+    if hundredths == 100:
+        seconds += 1
+        hundredths = 0
+
+    ser.write(bytearray(f"set_time_at {seconds} {hundredths}\r\n", 'utf-8'))
+    line = ser.readline()
+    while line.decode('utf-8').strip() != "ready":
+        line = ser.readline()
+
+    delay = target - time.time() - latency - BYTE_TIME
+    if delay < 0:
+        raise RuntimeError("set_time_at handshake took longer than the lead time")
+    ser.write(bytearray(f"{int(delay * 1000000)}\n", 'utf-8'))
+
+    line = ser.readline().decode('utf-8').strip()
+    while not line.startswith("residual"):
+        line = ser.readline().decode('utf-8').strip()
+    residual = int(line.split()[1])
+    print("Scheduled set_time residual in microseconds: " + str(residual))
+    return residual
+
+# constant_time("/dev/ttyUSB1")
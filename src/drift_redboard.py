@@ -0,0 +1,84 @@
+# SPDX-License-Identifier: Apache-2.0
+# SPDX-FileCopyrightText 2023 Gabriel Marcano
+
+"""
+Trims the RTC's XT oscillator against the host clock. Each session measures
+the offset periodically, fits a line to the offsets over time, and sends the
+slope to the device's cal_xt command, which folds it into the calibration
+registers. Sessions after the first measure the drift left by the previous
+trim, so the history shows how well the trims converge.
+"""
+
+import argparse
+import csv
+import time
+import numpy
+import serial
+from server_test_time_redboard import server_test_time_burst
+
+def measure_drift(ser, interval, duration):
+    """
+    Returns the drift in ppb (positive if the RTC runs slow) and the RMS
+    residual of the fit in seconds
+    """
+    times = []
+    offsets = []
+    end = time.time() + duration
+    while True:
+        times.append(time.time())
+        offsets.append(server_test_time_burst(ser, 100))
+        if times[-1] + interval > end:
+            break
+        time.sleep(interval)
+
+    # The offset is host minus RTC, so it grows when the RTC runs slow
+    slope, intercept = numpy.polyfit(times, offsets, 1)
+    fit = numpy.polyval([slope, intercept], times)
+    rms = numpy.sqrt(numpy.mean((numpy.array(offsets) - fit) ** 2))
+    return slope * 1e9, rms
+
+def trim(ser, ppb):
+    """
+    Sends a correction to the device, returning the part of it that the
+    calibration registers could not represent, in ppb
+    """
+    ser.reset_input_buffer()
+    ser.write(bytearray(f"cal_xt {round(ppb)}\r\n", 'utf-8'))
+    while True:
+        line = ser.readline().decode('utf-8').strip()
+        if line.startswith("residual"):
+            residual = int(line.split()[1])
+        elif line.startswith("offsetx"):
+            print(line)
+            return residual
+        elif line.startswith("Error"):
+            raise RuntimeError(line)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("port", help="serial port of the RedBoard")
+    parser.add_argument("--interval", type=float, default=60,
+        help="seconds between offset measurements")
+    parser.add_argument("--duration", type=float, default=3600,
+        help="seconds of measurements per session")
+    parser.add_argument("--sessions", type=int, default=1,
+        help="number of measure and trim sessions")
+    parser.add_argument("--history", default="drift_history.csv",
+        help="CSV file the result of every session is appended to")
+    args = parser.parse_args()
+
+    ser = serial.Serial(args.port)
+    ser.baudrate = 115200
+    time.sleep(0.5)
+
+    for session in range(args.sessions):
+        drift, rms = measure_drift(ser, args.interval, args.duration)
+        print(f"Drift: {drift:.0f} ppb, fit RMS residual: {rms * 1e6:.1f} us")
+        residual = trim(ser, drift)
+        print(f"Trim residual: {residual} ppb")
+
+        with open(args.history, 'a', newline='') as history:
+            csv.writer(history).writerow([time.time(), args.port, round(drift), rms, residual])
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#include <irq.h>
+
+#include <rtc.h>
+#include <clock.h>
+#include <stats.h>
+
+#include "am_mcu_apollo.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ARRAY_SIZE(ARG) (sizeof(ARG)/sizeof(*ARG))
+
+// Lines serviced by the GPIO interrupt
+static struct irq *active_irq;
+
+void am_gpio_isr(void)
+{
+	uint64_t status;
+	am_hal_gpio_interrupt_status_get(false, &status);
+	am_hal_gpio_interrupt_clear(status);
+	if (!active_irq)
+		return;
+
+	uint64_t ticks = clock_ticks(active_irq->clock);
+	for (size_t i = 0; i < ARRAY_SIZE(active_irq->lines); ++i)
+	{
+		struct irq_line *line = &active_irq->lines[i];
+		// Latency is measured from the first edge not yet dispatched
+		if ((status & AM_HAL_GPIO_BIT(line->pin)) && !line->pending)
+		{
+			line->edge_ticks = ticks;
+			line->pending = true;
+		}
+	}
+}
+
+void irq_init(struct irq *irq, struct rtc_interrupts *interrupts, struct clock *clock)
+{
+	irq->interrupts = interrupts;
+	irq->clock = clock;
+	irq->lines[0].pin = IRQ_NIRQ_PIN;
+	irq->lines[1].pin = IRQ_NIRQ2_PIN;
+	irq->last_latency = 0;
+	irq->max_latency = 0;
+	irq->dispatches = 0;
+
+	// The RTC outputs are open drain and active low
+	am_hal_gpio_pincfg_t config = g_AM_HAL_GPIO_INPUT_PULLUP;
+	config.eIntDir = AM_HAL_GPIO_PIN_INTDIR_HI2LO;
+	for (size_t i = 0; i < ARRAY_SIZE(irq->lines); ++i)
+	{
+		struct irq_line *line = &irq->lines[i];
+		line->pending = false;
+		am_hal_gpio_pinconfig(line->pin, config);
+		am_hal_gpio_interrupt_clear(AM_HAL_GPIO_BIT(line->pin));
+		am_hal_gpio_interrupt_enable(AM_HAL_GPIO_BIT(line->pin));
+	}
+	active_irq = irq;
+	NVIC_EnableIRQ(GPIO_IRQn);
+}
+
+bool irq_pending(const struct irq *irq)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(irq->lines); ++i)
+	{
+		if (irq->lines[i].pending)
+			return true;
+	}
+	return false;
+}
+
+bool irq_service(struct irq *irq)
+{
+	bool pending = false;
+	uint64_t edge = UINT64_MAX;
+	uint32_t state = am_hal_interrupt_master_disable();
+	for (size_t i = 0; i < ARRAY_SIZE(irq->lines); ++i)
+	{
+		struct irq_line *line = &irq->lines[i];
+		if (!line->pending)
+			continue;
+		pending = true;
+		if (line->edge_ticks < edge)
+			edge = line->edge_ticks;
+		line->pending = false;
+	}
+	am_hal_interrupt_master_set(state);
+	if (!pending)
+		return false;
+
+	// Both lines share the Status register, one read covers them
+	uint32_t start = stats_start();
+	uint8_t status = rtc_interrupts_read(irq->interrupts);
+	stats_record(&stats_probes[STATS_STATUS_READ], start);
+	uint64_t latency = (clock_ticks(irq->clock) - edge) * 1000000 / irq->clock->rate;
+	irq->last_latency = latency;
+	if (latency > irq->max_latency)
+		irq->max_latency = latency;
+	irq->dispatches += 1;
+
+	rtc_interrupts_run(irq->interrupts, status);
+	return true;
+}
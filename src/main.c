@@ -2,6 +2,11 @@
 // SPDX-FileCopyrightText: Gabriel Marcano, 2023
 
 #include <rtc.h>
+#include <frame.h>
+#include <clock.h>
+#include <irq.h>
+#include <stats.h>
+#include <spi_rate.h>
 
 #include <cli.h>
 #include <uart.h>
@@ -9,10 +14,12 @@
 
 #include "am_mcu_apollo.h"
 #include "am_bsp.h"
+#include "am_util.h"
 
 #include <sys/time.h>
 
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
@@ -21,10 +28,57 @@
 
 struct uart *uart;
 struct am1815 rtc;
+struct rtc_cache cache;
+struct clock mcu_clock;
+struct rtc_alarm_scheduler alarms;
+struct rtc_interrupts interrupts;
+struct irq irq;
+struct rtc_log event_log;
+struct rtc_snapshot snapshot;
 struct spi_bus *spi;
 struct spi_device *rtc_spi;
 struct cli cli;
 
+// What rtc_config_init found at boot
+static enum rtc_config_status config_status;
+
+// The alarm fired, so the RTC reached the armed deadline even if the MCU clock
+// lags it slightly. A deadline further out than a hundredth is one more than
+// a year away, whose alarm matched a year early, and is left for service to
+// arm again.
+static void alarm_interrupt(void *context, uint8_t status)
+{
+	(void)status;
+	struct rtc_alarm_scheduler *scheduler = context;
+	struct timeval now = clock_now(&mcu_clock);
+	if (scheduler->is_armed)
+	{
+		int64_t early = (int64_t)(scheduler->armed.tv_sec - now.tv_sec) * 1000000 +
+			(scheduler->armed.tv_usec - now.tv_usec);
+		if (early > 0 && early <= 10000)
+			now = scheduler->armed;
+	}
+	rtc_alarm_service(scheduler, &now);
+}
+
+// Add a record to the event log at the current time
+static void log_event(uint8_t type, int16_t data)
+{
+	struct timeval now = clock_now(&mcu_clock);
+	rtc_log_append(&event_log, &now, type, data);
+}
+
+static int16_t clamp_int16(int64_t value)
+{
+	return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : (int16_t)value;
+}
+
+static void power_interrupt(void *context, uint8_t status)
+{
+	(void)context;
+	log_event(RTC_LOG_POWER, status);
+}
+
 __attribute__((constructor))
 static void redboard_init(void)
 {
@@ -38,14 +92,33 @@ static void redboard_init(void)
 
 	spi = spi_bus_get_instance(SPI_BUS_0);
 	spi_bus_enable(spi);
-	rtc_spi = spi_device_get_instance(spi, SPI_CS_3, 2000000u);
+	rtc_spi = spi_device_get_instance(spi, SPI_CS_3, SPI_RATE_SAFE);
 	am1815_init(&rtc, rtc_spi);
+	// On warm resets the RTC is already configured, this only checks that
+	config_status = rtc_config_init(&cache, &rtc);
+	clock_init(&mcu_clock, &rtc);
+#ifdef RTC_SPI_RATE_AT_BOOT
+	// Move the RTC to the fastest SPI clock within its rating that the board
+	// handles reliably
+	struct spi_rate_result rates[SPI_RATE_COUNT];
+	spi_rate_select(spi, &rtc_spi, &rtc, &mcu_clock, rates);
+#endif
+	rtc_alarm_init(&alarms, &cache);
+	rtc_interrupts_init(&interrupts, &cache);
+	rtc_interrupts_register(&interrupts, RTC_STATUS_ALM, alarm_interrupt, &alarms);
+	irq_init(&irq, &interrupts, &mcu_clock);
+	rtc_log_init(&event_log, &cache);
+	rtc_snapshot_init(&snapshot, &cache);
+	rtc_interrupts_register(&interrupts, RTC_STATUS_BAT, power_interrupt, NULL);
+	log_event(RTC_LOG_BOOT, rtc_cache_read(&cache, 0x1D));
 
 	cli_init(&cli);
 	uart = uart_get_instance(UART_INST0);
 	syscalls_uart_init(uart);
 	syscalls_rtc_init(&rtc);
 
+	stats_init();
+
 	// After init is done, enable interrupts
 	am_hal_interrupt_master_enable();
 }
@@ -62,38 +135,58 @@ struct command
 	const char *command;
 	const char *help;
 	void *context;
-	int (*function)(void *context, const char *line);
+	int (*function)(void *context, size_t argc, const char *argv[]);
 };
 
 #define ARRAY_SIZE(ARG) (sizeof(ARG)/sizeof(*ARG))
 
-int command_exit(void *context, const char *line)
+// Most arguments any command takes, including the command name itself
+#define MAX_ARGS 8
+
+// Parse an integer argument in [min, max], returns false if it isn't one or
+// has anything after its digits
+static bool parse_long(const char *arg, long min, long max, long *result)
+{
+	char *ptr;
+	long value = strtol(arg, &ptr, 0);
+	if (arg == ptr || *ptr || value < min || value > max)
+		return false;
+	*result = value;
+	return true;
+}
+
+int command_exit(void *context, size_t argc, const char *argv[])
 {
 	(void)context;
-	(void)line;
+	(void)argc;
+	(void)argv;
 	return -2;
 }
-int command_name(void *context, const char *line)
+int command_name(void *context, size_t argc, const char *argv[])
 {
 	(void)context;
-	(void)line;
+	(void)argc;
+	(void)argv;
 	printf("Redboard Artemis RTC Configuration\r\n");
 	return 0;
 }
 
-int command_help(void *context, const char *line);
-int command_echo(void *context, const char *line)
+int command_help(void *context, size_t argc, const char *argv[]);
+int command_stats(void *context, size_t argc, const char *argv[]);
+int command_echo(void *context, size_t argc, const char *argv[])
 {
-	(void)line;
+	(void)argc;
+	(void)argv;
 	struct cli *cli = context;
 	cli->echo = !cli->echo;
 	return 0;
 }
 
-int command_history(void *context, const char *line)
+int command_history(void *context, size_t argc, const char *argv[])
 {
 	(void)context;
-	(void)line;
+	(void)argc;
+	(void)argv;
 	size_t max = ring_buffer_in_use(&cli.history);
 	for (size_t i = 0; i < max; ++i)
 	{
@@ -102,71 +195,53 @@ int command_history(void *context, const char *line)
 	return 0;
 }
 
-int command_read(void *context, const char *line)
+int command_read(void *context, size_t argc, const char *argv[])
 {
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-
 	struct am1815 *rtc = context;
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	if (argc < 2)
 	{
 		printf("Error: no address provided\r\n");
-		goto err;
+		return -1;
 	}
-	char *ptr;
-	long addr = strtol(tok, &ptr, 0);
-	if (tok == ptr || addr < 0 || addr > 255)
+	long addr;
+	if (!parse_long(argv[1], 0, 255, &addr))
 	{
 		printf("Error: invalid address\r\n");
-		goto err;
+		return -1;
 	}
 	uint8_t result = am1815_read_register(rtc, addr);
 	printf("%"PRIu8"\r\n", result);
 
-	free(buf);
 	return 0;
-
-err:
-	free(buf);
-	return -1;
 }
 
-int command_read_bulk(void *context, const char *line)
+int command_read_bulk(void *context, size_t argc, const char *argv[])
 {
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-
 	struct am1815 *rtc = context;
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	if (argc < 2)
 	{
 		printf("Error: no address provided\r\n");
-		goto err;
+		return -1;
 	}
-	char *ptr;
-	long addr = strtol(tok, &ptr, 0);
-	if (tok == ptr || addr < 0 || addr > 255)
+	long addr;
+	if (!parse_long(argv[1], 0, 255, &addr))
 	{
 		printf("Error: invalid address\r\n");
-		goto err;
+		return -1;
 	}
 
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	if (argc < 3)
 	{
 		printf("Error: no size provided\r\n");
-		goto err;
+		return -1;
 	}
-	long size = strtol(tok, &ptr, 0);
-	if (tok == ptr || size < 1 || size > 255)
+	long size;
+	if (!parse_long(argv[2], 1, 255, &size))
 	{
 		printf("Error: invalid size\r\n");
-		goto err;
+		return -1;
 	}
-	uint8_t *buffer = malloc(size);
+	uint8_t buffer[255];
 	am1815_read_bulk(rtc, addr, buffer, size);
 	printf("0x%"PRIX8, buffer[0]);
 	for (size_t i = 1; i < (uint8_t)size; ++i)
@@ -174,134 +249,144 @@ int command_read_bulk(void *context, const char *line)
 		printf(" 0x%"PRIX8, buffer[i]);
 	}
 	printf("\r\n");
-	free(buffer);
-
 
-	free(buf);
 	return 0;
-
-err:
-	free(buf);
-	return -1;
 }
 
-int command_write(void *context, const char *line)
+int command_write(void *context, size_t argc, const char *argv[])
 {
-	struct am1815 *rtc = context;
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	struct rtc_cache *cache = context;
+	if (argc < 2)
 	{
 		printf("Error: no address provided\r\n");
-		goto err;
+		return -1;
 	}
-	char *ptr;
-	long addr = strtol(tok, &ptr, 0);
-	if (tok == ptr || addr < 0 || addr > 255)
+	long addr;
+	if (!parse_long(argv[1], 0, 255, &addr))
 	{
 		printf("Error: invalid address\r\n");
-		goto err;
+		return -1;
 	}
 
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	if (argc < 3)
 	{
 		printf("Error: no data provided\r\n");
-		goto err;
+		return -1;
 	}
-	long data = strtol(tok, &ptr, 0);
-	if (tok == ptr || data < 0 || data > 255)
+	long data;
+	if (!parse_long(argv[2], 0, 255, &data))
 	{
 		printf("Error: invalid data\r\n");
-		goto err;
+		return -1;
 	}
 
-	am1815_write_register(rtc, (uint8_t)addr, (uint8_t)data);
+	rtc_cache_write(cache, (uint8_t)addr, (uint8_t)data);
+	// Writing a time register moves the RTC under the clock's anchor
+	if (addr <= 0x07)
+		clock_resync(&mcu_clock);
 	return 0;
-
-err:
-	free(buf);
-	return -1;
 }
 
-int command_trickle(void *context, const char *line)
+int command_trickle(void *context, size_t argc, const char *argv[])
 {
-	struct am1815 *rtc = context;
-
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	struct rtc_cache *cache = context;
+	if (argc < 2)
 	{
 		printf("Error: no argument provided\r\n");
-		goto err;
+		return -1;
 	}
-	char *ptr;
-	long data = strtol(tok, &ptr, 0);
-	if (tok == ptr || data < 0 || data > 1)
+	long data;
+	if (!parse_long(argv[1], 0, 1, &data))
 	{
 		printf("Error: invalid data\r\n");
-		goto err;
+		return -1;
 	}
 
 	if (data == 0)
-		am1815_disable_trickle(rtc);
+		am1815_disable_trickle(cache->rtc);
 	else
-		am1815_enable_trickle(rtc);
+		am1815_enable_trickle(cache->rtc);
+	// The driver writes the trickle register directly
+	rtc_cache_invalidate(cache, 0x20, 1);
 
 	return 0;
-err:
-	free(buf);
-	return -1;
 }
 
-int command_disable_pin(void *context, const char *line)
+int command_diff(void *context, size_t argc, const char *argv[])
 {
-	(void)line;
-	struct am1815 *rtc = context;
-	disable_pins(rtc);
+	struct rtc_snapshot *snapshot = context;
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "full") != 0)
+		{
+			printf("Error: invalid argument\r\n");
+			return -1;
+		}
+		snapshot->has_previous = false;
+	}
+	uint64_t changed = rtc_snapshot_take(snapshot);
+	// Flags the read cleared still have to reach their callbacks
+	rtc_interrupts_run(&interrupts, snapshot->registers[0x0F]);
+
+	// Changed registers as address and value hex pairs on one line
+	unsigned count = 0;
+	for (size_t i = 0; i < RTC_SNAPSHOT_SIZE; ++i)
+		count += (changed >> i) & 1;
+	printf("diff %u ", count);
+	for (size_t i = 0; i < RTC_SNAPSHOT_SIZE; ++i)
+	{
+		if (changed & (1ull << i))
+			printf("%02X%02X", (unsigned)i, snapshot->registers[i]);
+	}
+	printf("\r\n");
+
 	return 0;
 }
 
-int command_prog_osc(void *context, const char *line)
+int command_disable_pin(void *context, size_t argc, const char *argv[])
 {
-	(void)line;
-	struct am1815 *rtc = context;
-	// get access to osillator control register
-	am1815_write_register(rtc, 0x1F, 0xA1);
+	(void)argc;
+	(void)argv;
+	struct rtc_cache *cache = context;
+	disable_pins(cache);
+	return 0;
+}
+
+int command_prog_osc(void *context, size_t argc, const char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	struct rtc_cache *cache = context;
+	struct rtc_transaction tx;
+	rtc_transaction_begin(&tx, cache);
 
 	// clear the OF bit so that a failure isn't detected on start up
-	uint8_t OF = am1815_read_register(rtc, 0x1D);
+	// the oscillator status register is not key protected, only oscillator
+	// control is
 	uint8_t OFmask = 0b00000010;
-	uint8_t OFresult = OF & ~OFmask;
-	am1815_write_register(rtc, 0x1D, OFresult);
+	rtc_transaction_update(&tx, 0x1D, OFmask, 0);
+	rtc_transaction_commit(&tx);
 
 	return 0;
 }
 
-int command_osc_failover(void *context, const char *line)
+int command_osc_failover(void *context, size_t argc, const char *argv[])
 {
-	struct am1815 *rtc = context;
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	struct rtc_cache *cache = context;
+	if (argc < 2)
 	{
 		printf("Error: no argument provided\r\n");
-		goto err;
+		return -1;
 	}
-	char *ptr;
-	long data = strtol(tok, &ptr, 0);
-	if (tok == ptr || data < 0 || data > 1)
+	long data;
+	if (!parse_long(argv[1], 0, 1, &data))
 	{
 		printf("Error: invalid data\r\n");
-		goto err;
+		return -1;
 	}
-	uint8_t osCtrl = am1815_read_register(rtc, 0x1C);
+	struct rtc_transaction tx;
+	rtc_transaction_begin(&tx, cache);
+	uint8_t osCtrl = rtc_transaction_read(&tx, 0x1C);
 	uint8_t FOSmask = 0b00001000;
 	uint8_t FOSresult;
 	if(data == 0)
@@ -315,37 +400,30 @@ int command_osc_failover(void *context, const char *line)
 		FOSresult = osCtrl | FOSmask;
 		printf("enabled automatic switching when an oscillator failure is detected\r\n");
 	}
-	// get access to oscillator control register
-	am1815_write_register(rtc, 0x1F, 0xA1);
-	am1815_write_register(rtc, 0x1C, FOSresult);
+	// the commit unlocks the oscillator control register
+	rtc_transaction_write(&tx, 0x1C, FOSresult);
+	rtc_transaction_commit(&tx);
 
 	return 0;
-
-err:
-	free(buf);
-	return -1;
 }
 
-int command_osc_batover(void *context, const char *line)
+int command_osc_batover(void *context, size_t argc, const char *argv[])
 {
-	struct am1815 *rtc = context;
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	struct rtc_cache *cache = context;
+	if (argc < 2)
 	{
 		printf("Error: no argument provided\r\n");
-		goto err;
+		return -1;
 	}
-	char *ptr;
-	long data = strtol(tok, &ptr, 0);
-	if (tok == ptr || data < 0 || data > 1)
+	long data;
+	if (!parse_long(argv[1], 0, 1, &data))
 	{
 		printf("Error: invalid data\r\n");
-		goto err;
+		return -1;
 	}
-	uint8_t osCtrl = am1815_read_register(rtc, 0x1C);
+	struct rtc_transaction tx;
+	rtc_transaction_begin(&tx, cache);
+	uint8_t osCtrl = rtc_transaction_read(&tx, 0x1C);
 	uint8_t AOSmask = 0b00010000;
 	uint8_t AOSresult;
 	if(data == 0)
@@ -359,115 +437,213 @@ int command_osc_batover(void *context, const char *line)
 		AOSresult = osCtrl | AOSmask;
 		printf("enabled automatic switching when battery powered\r\n");
 	}
-	// get access to oscillator control register
-	am1815_write_register(rtc, 0x1F, 0xA1);
-	am1815_write_register(rtc, 0x1C, AOSresult);
+	// the commit unlocks the oscillator control register
+	rtc_transaction_write(&tx, 0x1C, AOSresult);
+	rtc_transaction_commit(&tx);
 
 	return 0;
-err:
-	free(buf);
-	return -1;
 }
 
-int command_alarm(void *context, const char *line)
+int command_alarm(void *context, size_t argc, const char *argv[])
 {
-	struct am1815 *rtc = context;
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	struct rtc_cache *cache = context;
+	if (argc < 2)
 	{
 		printf("Error: no enable argument provided\r\n");
-		goto err;
+		return -1;
 	}
 	bool enable;
-	if (strcmp(tok, "true") == 0)
+	if (strcmp(argv[1], "true") == 0)
 		enable = true;
-	else if (strcmp(tok, "false") == 0)
+	else if (strcmp(argv[1], "false") == 0)
 		enable = false;
 	else
 	{
 		printf("Error: invalid enable argument\r\n");
-		goto err;
+		return -1;
 	}
 
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	if (argc < 3)
 	{
 		printf("Error: no pulse argument provided\r\n");
-		goto err;
+		return -1;
 	}
-	char *ptr;
-	long data = strtol(tok, &ptr, 0);
-	if (tok == ptr || data < 0 || data > 3)
+	long data;
+	if (!parse_long(argv[2], 0, 3, &data))
 	{
 		printf("Error: invalid pulse argument\r\n");
-		goto err;
+		return -1;
 	}
 
-	configure_alarm(rtc, enable, (uint8_t)data);
+	// The scheduler owns the alarm registers while it has events
+	if (rtc_alarm_next(&alarms))
+	{
+		printf("Error: scheduled events pending\r\n");
+		return -1;
+	}
+	configure_alarm(cache, enable, (uint8_t)data);
 
 	return 0;
-
-err:
-	free(buf);
-	return -1;
 }
 
-int command_countdown(void *context, const char *line)
+int command_countdown(void *context, size_t argc, const char *argv[])
 {
-	struct am1815 *rtc = context;
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	struct rtc_cache *cache = context;
+	if (argc < 2)
 	{
 		printf("Error: no argument provided\r\n");
-		goto err;
+		return -1;
 	}
 	char *ptr;
-	double data = strtod(tok, &ptr);
+	double data = strtod(argv[1], &ptr);
 
-	if (tok == ptr || data < 0 || data > 15360)
+	if (argv[1] == ptr || data < 0 || data > 15360)
 	{
 		printf("Error: invalid data\r\n");
-		goto err;
+		return -1;
 	}
 
-	configure_countdown(rtc, data);
+	configure_countdown(cache, data);
 
 	return 0;
+}
+
+int command_cal_xt(void *context, size_t argc, const char *argv[])
+{
+	struct rtc_cache *cache = context;
+	struct xt_calibration cal;
+	read_xt_calibration(cache, &cal);
+	int64_t current = xt_calibration_ppb(&cal);
+
+	// Without an argument just report the calibration in effect
+	if (argc > 1)
+	{
+		// The correction is measured with the current calibration applied,
+		// so it adds to it
+		long correction;
+		if (!parse_long(argv[1], XT_CALIBRATION_MIN_PPB, XT_CALIBRATION_MAX_PPB, &correction))
+		{
+			printf("Error: invalid correction\r\n");
+			return -1;
+		}
+		int64_t target = current + correction;
+		if (!xt_calibration_from_ppb(target, &cal))
+		{
+			printf("Error: %lld ppb is out of calibration range\r\n", (long long)target);
+			return -1;
+		}
+		configure_xt_calibration(cache, &cal);
+		current = xt_calibration_ppb(&cal);
+		log_event(RTC_LOG_CALIBRATION, clamp_int16(current / 100));
+		printf("residual %lld ppb\r\n", (long long)(target - current));
+	}
+	printf("offsetx %d cmdx %d xtcal %u, adjustment %lld ppb\r\n",
+		cal.offsetx, cal.cmdx, cal.xtcal, (long long)current);
 
-err:
-	free(buf);
-	return -1;
+	return 0;
 }
 
-int command_init(void *context, const char *line)
+// How long autocalibration is given to finish before its result is read
+#define RC_AUTOCAL_WAIT_MS 1000
+
+int command_cal_rc(void *context, size_t argc, const char *argv[])
 {
-	(void)line;
-	struct am1815 *rtc = context;
-	// Write to bit 7 of register 1 to signal that this program initialized the RTC
-	uint8_t sec = am1815_read_register(rtc, 0x01);
-	uint8_t secMask = 0b10000000;
-	uint8_t secResult = sec | secMask;
-	am1815_write_register(rtc, 0x01, secResult);
-	configure_alarm(rtc, true, 1);
+	struct rtc_cache *cache = context;
+	// By default autocalibration runs once and is then turned off again, so
+	// the XT oscillator isn't powered up periodically
+	uint8_t acal = RTC_ACAL_OFF;
+	if (argc > 1)
+	{
+		long period;
+		if (!parse_long(argv[1], 512, 1024, &period) || (period != 512 && period != 1024))
+		{
+			printf("Error: period must be 512 or 1024\r\n");
+			return -1;
+		}
+		acal = period == 512 ? RTC_ACAL_512 : RTC_ACAL_1024;
+	}
+
+	// Enabling autocalibration starts a cycle right away
+	configure_autocalibration(cache, RTC_ACAL_512);
+	am_util_delay_ms(RC_AUTOCAL_WAIT_MS);
+	struct rc_calibration cal;
+	bool success = read_rc_calibration(cache, &cal);
+	if (acal != RTC_ACAL_512)
+		configure_autocalibration(cache, acal);
 
-	am1815_write_register(rtc, 0x1F, 0x9D);
-	am1815_write_register(rtc, 0x30, 0x01);
+	if (!success)
+	{
+		printf("Error: autocalibration failed, is the XT oscillator running?\r\n");
+		return -1;
+	}
+	// Kept in the RTC's user RAM for restore_rc, across MCU resets
+	rtc_rc_calibration_save(cache, &cal);
+	printf("Cal_RC 0x%02X 0x%02X, autocalibration %s\r\n", cal.hi, cal.lo,
+		acal == RTC_ACAL_OFF ? "off" : "on");
 
 	return 0;
 }
 
-int command_get_time(void *context, const char *line)
+int command_restore_rc(void *context, size_t argc, const char *argv[])
 {
-	(void)line;
-	struct am1815 *rtc = context;
+	(void)argc;
+	(void)argv;
+	struct rtc_cache *cache = context;
+	struct rc_calibration cal;
+	if (!rtc_rc_calibration_load(cache, &cal))
+	{
+		printf("Error: no RC calibration saved, run cal_rc first\r\n");
+		return -1;
+	}
+	configure_rc_calibration(cache, &cal);
+	printf("Cal_RC 0x%02X 0x%02X\r\n", cal.hi, cal.lo);
 
-	struct timeval curr_time = am1815_read_time(rtc);
+	return 0;
+}
+
+int command_init(void *context, size_t argc, const char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	struct rtc_cache *cache = context;
+	// init reprograms the alarm, which the scheduler owns while it has events
+	if (rtc_alarm_next(&alarms))
+	{
+		printf("Error: scheduled events pending\r\n");
+		return -1;
+	}
+	initialize_rtc(cache);
+	return 0;
+}
+
+int command_config(void *context, size_t argc, const char *argv[])
+{
+	struct rtc_cache *cache = context;
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "save") != 0)
+		{
+			printf("Error: invalid argument\r\n");
+			return -1;
+		}
+		rtc_config_save(cache);
+		config_status = RTC_CONFIG_MATCH;
+	}
+	static const char *names[] = {"match", "restored", "missing"};
+	printf("config %s\r\n", names[config_status]);
+
+	return 0;
+}
+
+int command_get_time(void *context, size_t argc, const char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	struct clock *clock = context;
+
+	// Served from the MCU counter, no SPI access unless the anchor is stale
+	clock_service(clock);
+	struct timeval curr_time = clock_now(clock);
 	char buf[21]; //uint64_t max number of decimal digits is 20 (log2(2^64) ~= 19.2)
 	uint64_t seconds = curr_time.tv_sec;
 
@@ -490,129 +666,831 @@ int command_get_time(void *context, const char *line)
 	return 0;
 }
 
-int command_set_time(void *context, const char *line)
+// Write the RTC time and bring the MCU clock and the event log along, for both
+// the text and the binary protocol
+static void set_time(struct clock *clock, const struct timeval *time)
 {
-	struct am1815 *rtc = context;
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
+	uint32_t start = stats_start();
+	am1815_write_time(clock->rtc, time);
+	stats_record(&stats_probes[STATS_WRITE_TIME], start);
+	clock_resync(clock);
+	log_event(RTC_LOG_TIME_SET, 0);
+}
 
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+// Step the RTC time, last read as current, by offset microseconds, like
+// set_time
+static void step_time(struct clock *clock, struct timeval current, int64_t offset)
+{
+	struct timeval time = timeval_add_us(current, offset);
+	uint32_t start = stats_start();
+	am1815_write_time(clock->rtc, &time);
+	stats_record(&stats_probes[STATS_WRITE_TIME], start);
+	clock_resync(clock);
+	log_event(RTC_LOG_TIME_STEP, clamp_int16(offset / 1000));
+}
+
+int command_set_time(void *context, size_t argc, const char *argv[])
+{
+	struct clock *clock = context;
+	if (argc < 2)
 	{
 		printf("Error: no seconds argument provided\r\n");
-		goto err;
+		return -1;
 	}
 	char *ptr;
-	long seconds = strtol(tok, &ptr, 0);
+	long seconds = strtol(argv[1], &ptr, 0);
+	if (argv[1] == ptr || *ptr)
+	{
+		printf("Error: invalid seconds argument\r\n");
+		return -1;
+	}
 
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	if (argc < 3)
 	{
 		printf("Error: no hundredths argument provided\r\n");
-		goto err;
+		return -1;
+	}
+	long hundredths;
+	if (!parse_long(argv[2], 0, 99, &hundredths))
+	{
+		printf("Error: invalid hundredths argument\r\n");
+		return -1;
 	}
-	long microseconds = strtol(tok, &ptr, 0) * 10000;
 
-	struct timeval tm = {.tv_sec = seconds, .tv_usec = microseconds};
-	am1815_write_time(rtc, &tm);
+	struct timeval tm = {.tv_sec = seconds, .tv_usec = hundredths * 10000};
+	set_time(clock, &tm);
 
 	return 0;
+}
 
-err:
-	free(buf);
-	return -1;
+// Wait for the next byte from the host, taking a counter timestamp as soon as
+// it is available. The asimple UART driver owns the receive interrupt, so the
+// byte is picked up by spinning on the receive buffer instead, which keeps
+// stdio buffering and SPI traffic out of the timestamp.
+static uint8_t uart_read_stamped(uint64_t *ticks)
+{
+	uint8_t byte;
+	while (uart_read(uart, &byte, 1) != 1)
+		;
+	*ticks = clock_ticks(&mcu_clock);
+	return byte;
 }
 
-int command_change_time(void *context, const char *line)
+int command_set_time_at(void *context, size_t argc, const char *argv[])
 {
-	struct am1815 *rtc = context;
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-	char *tok = strtok(buf, " \t\r\n");
-	tok = strtok(NULL, " \t\r\n");
-	if (!tok)
+	struct clock *clock = context;
+	if (argc < 2)
 	{
-		printf("Error: no offset argument provided\r\n");
-		goto err;
+		printf("Error: no seconds argument provided\r\n");
+		return -1;
 	}
 	char *ptr;
-	double offset = strtod(tok, &ptr);
+	long long seconds = strtoll(argv[1], &ptr, 0);
+	if (argv[1] == ptr || *ptr)
+	{
+		printf("Error: invalid seconds argument\r\n");
+		return -1;
+	}
+
+	if (argc < 3)
+	{
+		printf("Error: no hundredths argument provided\r\n");
+		return -1;
+	}
+	long hundredths;
+	if (!parse_long(argv[2], 0, 99, &hundredths))
+	{
+		printf("Error: invalid hundredths argument\r\n");
+		return -1;
+	}
+
+	// Any anchor refresh has to happen now, not while waiting on the deadline
+	clock_service(clock);
+
+	// The host answers with the delay in microseconds from the arrival of the
+	// answer's first byte to the instant the RTC should read the given time
+	printf("ready\r\n");
+	fflush(stdout);
+	uint64_t arrival, ticks;
+	char delay_line[16];
+	size_t length = 0;
+	uint8_t byte = uart_read_stamped(&arrival);
+	while (byte != '\n')
+	{
+		if (byte != '\r' && length < sizeof(delay_line) - 1)
+			delay_line[length++] = byte;
+		byte = uart_read_stamped(&ticks);
+	}
+	delay_line[length] = '\0';
+	long delay;
+	if (!parse_long(delay_line, 0, 10000000, &delay))
+	{
+		printf("Error: invalid delay\r\n");
+		return -1;
+	}
+
+	uint64_t deadline = arrival + (uint64_t)delay * clock->rate / 1000000;
+	struct timeval tm = {.tv_sec = seconds, .tv_usec = hundredths * 10000};
+
+	// Start early by the clock's last measured write time, so the write
+	// completes on the deadline. Spin on the counter rather than sleeping on a
+	// compare interrupt, the wake-up latency would be worse than the whole
+	// error budget.
+	uint64_t start = deadline - clock->write_ticks;
+	while (clock_ticks(clock) < start)
+		;
+	uint64_t write_start = clock_ticks(clock);
+	uint32_t start_cycles = stats_start();
+	am1815_write_time(&rtc, &tm);
+	uint64_t write_end = clock_ticks(clock);
+	stats_record(&stats_probes[STATS_WRITE_TIME], start_cycles);
+	clock->write_ticks = write_end - write_start;
+
+	clock_resync(clock);
+	log_event(RTC_LOG_TIME_SET, 0);
+
+	int64_t residual = (int64_t)(write_end - deadline) * 1000000 / clock->rate;
+	printf("residual %lld us\r\n", (long long)residual);
+	return 0;
+}
+
+// Parse a decimal number of seconds, as printed by Python (e.g. "-1.25" or
+// "3e-05"), into microseconds rounded to the nearest one. Done in integer
+// arithmetic, so no precision is lost to floating point.
+static bool parse_offset_us(const char *arg, int64_t *result)
+{
+	const char *ptr = arg;
+	bool negative = *ptr == '-';
+	if (*ptr == '-' || *ptr == '+')
+		++ptr;
+
+	// The value is mantissa * 10^exponent
+	int64_t mantissa = 0;
+	long exponent = 0;
+	bool digits = false, point = false;
+	for (; (*ptr >= '0' && *ptr <= '9') || (*ptr == '.' && !point); ++ptr)
+	{
+		if (*ptr == '.')
+		{
+			point = true;
+			continue;
+		}
+		digits = true;
+		// Digits past what fits only matter for rounding, drop them
+		if (mantissa < INT64_MAX / 100)
+		{
+			mantissa = mantissa * 10 + (*ptr - '0');
+			if (point)
+				--exponent;
+		}
+		else if (!point)
+		{
+			++exponent;
+		}
+	}
+	if (!digits)
+		return false;
+	if (*ptr == 'e' || *ptr == 'E')
+	{
+		// Always decimal, Python pads exponents with zeros (1e-08) that
+		// would otherwise make them octal
+		char *end;
+		long power = strtol(ptr + 1, &end, 10);
+		if (end == ptr + 1 || *end || power < -30 || power > 30)
+			return false;
+		exponent += power;
+	}
+	else if (*ptr)
+	{
+		return false;
+	}
 
-	if (tok == ptr)
+	exponent += 6;
+	for (; exponent > 0; --exponent)
+	{
+		if (mantissa > INT64_MAX / 10)
+			return false;
+		mantissa *= 10;
+	}
+	if (exponent < -19)
+		mantissa = 0;
+	// Truncate all but the first dropped digit, which decides the rounding
+	for (; exponent < -1; ++exponent)
+		mantissa /= 10;
+	if (exponent == -1)
+		mantissa = (mantissa + 5) / 10;
+
+	*result = negative ? -mantissa : mantissa;
+	return true;
+}
+
+int command_change_time(void *context, size_t argc, const char *argv[])
+{
+	struct clock *clock = context;
+	if (argc < 2)
+	{
+		printf("Error: no offset argument provided\r\n");
+		return -1;
+	}
+	int64_t offset;
+	if (!parse_offset_us(argv[1], &offset))
 	{
 		printf("Error: invalid offset data\r\n");
-		goto err;
+		return -1;
+	}
+
+	if (argc > 2)
+	{
+		if (strcmp(argv[2], "adjust"))
+		{
+			printf("Error: unknown mode %s\r\n", argv[2]);
+			return -1;
+		}
+		// Step the time at a hundredths rollover, so the only error is the
+		// rounding of the offset and the measured window
+		struct clock_adjustment adjustment;
+		if (!clock_adjust(clock, offset, &adjustment))
+		{
+			printf("Error: could not write within %d us of a rollover\r\n", CLOCK_ADJUST_MAX_WINDOW);
+			return -1;
+		}
+		log_event(RTC_LOG_TIME_STEP, clamp_int16(adjustment.applied / 1000));
+		printf("applied %lld us, residual %lld us, window %lu us, attempts %u\r\n",
+			(long long)adjustment.applied, (long long)(offset - adjustment.applied),
+			(unsigned long)adjustment.window, adjustment.attempts);
+		return 0;
 	}
 
 	// Change time of RTC by the given offset
-	struct timeval curr_time = am1815_read_time(rtc);
+	struct timeval curr_time = am1815_read_time(clock->rtc);
 
 	printf("RTC's old time: %llu seconds, %ld microseconds\r\n", curr_time.tv_sec, curr_time.tv_usec);
 
-	long offset_whole = (long) offset;
-	long offset_frac = (long) ((offset - offset_whole) * 1000000);
-	struct timeval new_time = {.tv_sec = curr_time.tv_sec + offset_whole, .tv_usec = curr_time.tv_usec + offset_frac};
-	am1815_write_time(rtc, &new_time);
+	step_time(clock, curr_time, offset);
 
-	curr_time = am1815_read_time(rtc);
+	curr_time = am1815_read_time(clock->rtc);
 	printf("RTC's new time: %llu seconds, %ld microseconds\r\n", curr_time.tv_sec, curr_time.tv_usec);
 
 	return 0;
-
-err:
-	free(buf);
-	return -1;
 }
 
-int command_ping(void *context, const char *line)
+int command_ping(void *context, size_t argc, const char *argv[])
 {
-	(void)line;
-	struct am1815 *rtc = context;
+	(void)argc;
+	(void)argv;
+	struct clock *clock = context;
+
+	// Refresh a stale anchor before the exchange so no SPI access happens
+	// during it
+	clock_service(clock);
 
 	const char* request = "request\r\n";
+	uint32_t start = stats_start();
 	uart_write(uart, (const uint8_t*)request, strlen(request));
-	struct timeval req_time = am1815_read_time(rtc);
+	uint64_t req_ticks = clock_ticks(clock);
+	stats_record(&stats_probes[STATS_UART_WRITE], start);
+
+	// The response time is when its first byte arrived, the rest of the line
+	// is just drained
+	uint64_t resp_ticks, ticks;
+	uint8_t byte = uart_read_stamped(&resp_ticks);
+	while (byte != '\n')
+		byte = uart_read_stamped(&ticks);
 
-	size_t size = 10;
-	char response[size];
-	fgets(response, size, stdin);
-	struct timeval resp_time = am1815_read_time(rtc);
+	struct timeval req_time = clock_ticks_to_time(clock, req_ticks);
+	struct timeval resp_time = clock_ticks_to_time(clock, resp_ticks);
 
 	char to_write[60];
 	snprintf(to_write, 60, "%llu %ld %llu %ld\r\n", req_time.tv_sec, req_time.tv_usec, resp_time.tv_sec, resp_time.tv_usec);
+	start = stats_start();
 	uart_write(uart, (const uint8_t*)to_write, strlen(to_write));
+	stats_record(&stats_probes[STATS_UART_WRITE], start);
+
+	return 0;
+}
+
+static void print_event(void *context)
+{
+	struct timeval now = clock_now(&mcu_clock);
+	printf("event %u fired at %llu.%06ld\r\n", (unsigned)(uintptr_t)context, now.tv_sec, now.tv_usec);
+}
+
+int command_schedule(void *context, size_t argc, const char *argv[])
+{
+	struct rtc_alarm_scheduler *scheduler = context;
+	static unsigned events;
+	long delay;
+	if (argc < 2 || !parse_long(argv[1], 0, 31536000, &delay))
+	{
+		printf("Error: expected a delay in [0, 31536000] s\r\n");
+		return -1;
+	}
+
+	struct timeval deadline = clock_now(&mcu_clock);
+	deadline.tv_sec += delay;
+	if (!rtc_alarm_schedule(scheduler, &deadline, print_event, (void *)(uintptr_t)events))
+	{
+		printf("Error: too many events pending\r\n");
+		return -1;
+	}
+	printf("event %u scheduled at %llu.%06ld\r\n", events, deadline.tv_sec, deadline.tv_usec);
+	events += 1;
 
 	return 0;
 }
 
+// How the main loop waits for input
+enum idle_mode
+{
+	// Spin in the CLI
+	IDLE_OFF,
+	// Sleep, clocks and peripherals keep running
+	IDLE_SLEEP,
+	// Deep sleep, the counter and UART clock may stop, so the clocks are
+	// restored and the counter re-anchored on wake
+	IDLE_DEEP,
+};
+
+static enum idle_mode idle_mode = IDLE_SLEEP;
+
+// Wake to first received byte latency of the last wait for input and the worst
+// one, in microseconds
+static uint32_t idle_latency;
+static uint32_t idle_max_latency;
+
+// Sleep until a byte arrives on the UART, dispatching RTC interrupts that wake
+// the MCU meanwhile. The byte is pushed back for the CLI to read.
+static void idle_wait_input(void)
+{
+	if (idle_mode == IDLE_OFF)
+		return;
+
+	bool slept_deep = false;
+	uint64_t wake = clock_ticks(&mcu_clock);
+	for (;;)
+	{
+		irq_service(&irq);
+
+		// Checking for input and going to sleep has to be atomic, or a byte
+		// arriving in between would only be seen at the next wake. Pending
+		// interrupts still end the sleep with interrupts masked.
+		uint8_t byte;
+		uint32_t state = am_hal_interrupt_master_disable();
+		bool received = uart_read(uart, &byte, 1) == 1;
+		if (!received && !irq_pending(&irq))
+			am_hal_sysctrl_sleep(idle_mode == IDLE_DEEP ? AM_HAL_SYSCTRL_SLEEP_DEEP : AM_HAL_SYSCTRL_SLEEP_NORMAL);
+		am_hal_interrupt_master_set(state);
+
+		if (received)
+		{
+			uint64_t latency = (clock_ticks(&mcu_clock) - wake) * 1000000 / mcu_clock.rate;
+			idle_latency = latency;
+			if (latency > idle_max_latency)
+				idle_max_latency = latency;
+			ungetc(byte, stdin);
+			break;
+		}
+
+		if (idle_mode == IDLE_DEEP)
+		{
+			am_hal_clkgen_control(AM_HAL_CLKGEN_CONTROL_SYSCLK_MAX, 0);
+			slept_deep = true;
+		}
+		wake = clock_ticks(&mcu_clock);
+	}
+
+	// The counter may have stopped in deep sleep, so the anchor is stale.
+	// The rest of the line is buffered by the UART meanwhile.
+	if (slept_deep)
+		clock_resync(&mcu_clock);
+}
+
+int command_idle(void *context, size_t argc, const char *argv[])
+{
+	(void)context;
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "off") == 0)
+			idle_mode = IDLE_OFF;
+		else if (strcmp(argv[1], "sleep") == 0)
+			idle_mode = IDLE_SLEEP;
+		else if (strcmp(argv[1], "deep") == 0)
+			idle_mode = IDLE_DEEP;
+		else
+		{
+			printf("Error: mode must be off, sleep, or deep\r\n");
+			return -1;
+		}
+		idle_max_latency = 0;
+	}
+	static const char *names[] = {"off", "sleep", "deep"};
+	printf("idle %s, wake to first byte last %lu us, max %lu us\r\n", names[idle_mode],
+		(unsigned long)idle_latency, (unsigned long)idle_max_latency);
+
+	return 0;
+}
+
+int command_irq(void *context, size_t argc, const char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	struct irq *irq = context;
+	irq_service(irq);
+	printf("dispatches %lu, latency last %lu us, max %lu us\r\n",
+		(unsigned long)irq->dispatches, (unsigned long)irq->last_latency,
+		(unsigned long)irq->max_latency);
+
+	return 0;
+}
+
+int command_spi_rate(void *context, size_t argc, const char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	struct clock *clock = context;
+	struct spi_rate_result results[SPI_RATE_COUNT];
+	uint32_t hz = spi_rate_select(spi, &rtc_spi, clock->rtc, clock, results);
+	for (size_t i = 0; i < SPI_RATE_COUNT; ++i)
+	{
+		if (!results[i].tested)
+			continue;
+		printf("rate %lu errors %lu bulk_ns %lu\r\n", (unsigned long)results[i].hz,
+			(unsigned long)results[i].errors, (unsigned long)results[i].bulk_ns);
+	}
+	if (!hz)
+	{
+		printf("Error: no rate passed, staying at %lu Hz\r\n", (unsigned long)SPI_RATE_SAFE);
+		return 0;
+	}
+	printf("selected %lu\r\n", (unsigned long)hz);
+
+	return 0;
+}
+
+int command_timer(void *context, size_t argc, const char *argv[])
+{
+	struct rtc_cache *cache = context;
+	int64_t period_us;
+	if (argc < 2 || !parse_offset_us(argv[1], &period_us) || period_us < 0 ||
+		period_us > (int64_t)RTC_TIMER_MAX_PERIOD * 1000000 / RTC_TIMER_TICKS_PER_SECOND)
+	{
+		printf("Error: expected a period in [0, 15360] s\r\n");
+		return -1;
+	}
+
+	struct rtc_timer_config config = {
+		.period = (period_us * RTC_TIMER_TICKS_PER_SECOND + 500000) / 1000000,
+		.repeat = true,
+		.pulse = true,
+		.output = RTC_TIMER_OUTPUT_NIRQ2,
+	};
+	for (size_t i = 2; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "repeat") == 0)
+			config.repeat = true;
+		else if (strcmp(argv[i], "once") == 0)
+			config.repeat = false;
+		else if (strcmp(argv[i], "pulse") == 0)
+			config.pulse = true;
+		else if (strcmp(argv[i], "level") == 0)
+			config.pulse = false;
+		else if (strcmp(argv[i], "nirq") == 0)
+			config.output = RTC_TIMER_OUTPUT_NIRQ;
+		else if (strcmp(argv[i], "nirq2") == 0)
+			config.output = RTC_TIMER_OUTPUT_NIRQ2;
+		else if (strcmp(argv[i], "none") == 0)
+			config.output = RTC_TIMER_OUTPUT_NONE;
+		else
+		{
+			printf("Error: unknown option %s\r\n", argv[i]);
+			return -1;
+		}
+	}
+
+	// OUT1S = 3 with AIE set is the alarm's nAIRQ on FOUT/nIRQ, which the
+	// scheduler waits on. Switching the pin to nIRQ would take it away.
+	if (config.output == RTC_TIMER_OUTPUT_NIRQ && config.period &&
+		(rtc_cache_read(cache, 0x11) & 0b00000011) == 0b00000011 &&
+		(rtc_cache_read(cache, 0x12) & 0b00000100))
+	{
+		printf("Error: FOUT/nIRQ carries the alarm, use nirq2\r\n");
+		return -1;
+	}
+
+	uint32_t period = configure_periodic_timer(cache, &config);
+	if (!period)
+	{
+		printf("Timer disabled\r\n");
+		return 0;
+	}
+	// Periods are exact multiples of 1/4096 s, which is a whole number of
+	// nanoseconds
+	uint64_t achieved_ns = (uint64_t)period * 1000000000 / RTC_TIMER_TICKS_PER_SECOND;
+	int64_t error_ns = (int64_t)achieved_ns - period_us * 1000;
+	printf("requested %lld us, achieved %llu ns (%lu/%u s), error %lld ns\r\n",
+		(long long)period_us, (unsigned long long)achieved_ns, (unsigned long)period,
+		RTC_TIMER_TICKS_PER_SECOND, (long long)error_ns);
+
+	return 0;
+}
+
+// Most exchanges a single ping_burst runs
+#define PING_BURST_MAX 100
+
+// Single byte markers of a ping_burst exchange, sent by the device and
+// answered by the host
+#define PING_BURST_REQUEST '>'
+#define PING_BURST_RESPONSE '<'
+
+int command_ping_burst(void *context, size_t argc, const char *argv[])
+{
+	struct clock *clock = context;
+	long count;
+	if (argc < 2 || !parse_long(argv[1], 1, PING_BURST_MAX, &count))
+	{
+		printf("Error: expected a count in [1, %d]\r\n", PING_BURST_MAX);
+		return -1;
+	}
+
+	// Refresh a stale anchor before the exchanges so no SPI access happens
+	// during them
+	clock_service(clock);
+	printf("burst\r\n");
+	fflush(stdout);
+
+	// Only counter values are taken during the burst, all conversion and
+	// printing is left to the end
+	static uint64_t req_ticks[PING_BURST_MAX];
+	static uint64_t resp_ticks[PING_BURST_MAX];
+	const uint8_t request = PING_BURST_REQUEST;
+	for (long i = 0; i < count; ++i)
+	{
+		uart_write(uart, &request, 1);
+		req_ticks[i] = clock_ticks(clock);
+		// Skip anything that isn't the answer, such as the end of the
+		// command line
+		while (uart_read_stamped(&resp_ticks[i]) != PING_BURST_RESPONSE)
+			;
+	}
+
+	// All times are in microseconds from the first request
+	struct timeval base = clock_ticks_to_time(clock, req_ticks[0]);
+	printf("%ld %llu %ld\r\n", count, base.tv_sec, base.tv_usec);
+	for (long i = 0; i < count; ++i)
+	{
+		uint64_t req = (req_ticks[i] - req_ticks[0]) * 1000000 / clock->rate;
+		uint64_t resp = (resp_ticks[i] - req_ticks[0]) * 1000000 / clock->rate;
+		printf("%llu %llu\r\n", req, resp);
+	}
+
+	return 0;
+}
+
+int command_log_dump(void *context, size_t argc, const char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	struct rtc_log *log = context;
+	static struct rtc_log_record records[RTC_LOG_SLOTS];
+	size_t count = rtc_log_read(log, records);
+
+	static const char *types[] = {"empty", "epoch", "boot", "time_set", "time_step", "calibration", "power"};
+	printf("log %u\r\n", (unsigned)count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const struct rtc_log_record *record = &records[i];
+		const char *type = record->type < ARRAY_SIZE(types) ? types[record->type] : "unknown";
+		if (record->time_known)
+			printf("%u %s %lld %d\r\n", record->seq, type, (long long)record->time, record->data);
+		else
+			printf("%u %s ? %d\r\n", record->seq, type, record->data);
+	}
+
+	return 0;
+}
+
+static void put_timeval(uint8_t *data, struct timeval time)
+{
+	frame_put_u64(data, time.tv_sec);
+	frame_put_u32(data + 8, time.tv_usec);
+}
+
+static void binary_write_frame(const struct frame *frame)
+{
+	uint8_t buffer[FRAME_MAX_SIZE];
+	size_t size = frame_encode(frame, buffer);
+	uart_write(uart, buffer, size);
+}
+
+static void binary_write_error(enum frame_error error)
+{
+	struct frame frame = {.opcode = FRAME_ERROR, .size = 1, .payload = {error}};
+	binary_write_frame(&frame);
+}
+
+// Block until a valid frame arrives, reporting malformed ones to the host.
+// start is set to the counter value at which the frame's first byte arrived.
+static void binary_read_frame(struct frame_decoder *decoder, struct frame *frame, uint64_t *start)
+{
+	for (;;)
+	{
+		uint64_t ticks;
+		uint8_t byte = uart_read_stamped(&ticks);
+		if (decoder->received == 0)
+			*start = ticks;
+		int result = frame_decoder_push(decoder, byte, frame);
+		if (result > 0)
+			return;
+		if (result < 0)
+			binary_write_error(-result);
+	}
+}
+
+// Handle one request frame, filling in the response. Invalid requests get a
+// FRAME_ERROR response carrying the error code.
+static void binary_handle(struct frame_decoder *decoder, const struct frame *request, struct frame *response)
+{
+	response->opcode = request->opcode | FRAME_RESPONSE;
+	response->size = 0;
+	switch (request->opcode)
+	{
+	case FRAME_GET_TIME:
+	{
+		clock_service(&mcu_clock);
+		struct timeval time = clock_now(&mcu_clock);
+		put_timeval(response->payload, time);
+		response->size = 12;
+		return;
+	}
+	case FRAME_SET_TIME:
+	{
+		if (request->size != 9 || request->payload[8] > 99)
+			break;
+		struct timeval time = {
+			.tv_sec = frame_get_u64(request->payload),
+			.tv_usec = request->payload[8] * 10000,
+		};
+		set_time(&mcu_clock, &time);
+		return;
+	}
+	case FRAME_CHANGE_TIME:
+	{
+		if (request->size != 8)
+			break;
+		int64_t offset = (int64_t)frame_get_u64(request->payload);
+		step_time(&mcu_clock, am1815_read_time(&rtc), offset);
+		put_timeval(response->payload, clock_now(&mcu_clock));
+		response->size = 12;
+		return;
+	}
+	case FRAME_PING:
+	{
+		clock_service(&mcu_clock);
+		struct frame ping = {.opcode = FRAME_PING_REQUEST, .size = 0};
+		binary_write_frame(&ping);
+		uint64_t req_ticks = clock_ticks(&mcu_clock);
+		uint64_t resp_ticks;
+		do
+		{
+			binary_read_frame(decoder, &ping, &resp_ticks);
+		} while (ping.opcode != FRAME_PING_RESPONSE);
+		struct timeval req_time = clock_ticks_to_time(&mcu_clock, req_ticks);
+		struct timeval resp_time = clock_ticks_to_time(&mcu_clock, resp_ticks);
+		put_timeval(response->payload, req_time);
+		put_timeval(response->payload + 12, resp_time);
+		response->size = 24;
+		return;
+	}
+	case FRAME_READ:
+	{
+		// The register address doesn't wrap around past 0xFF
+		if (request->size != 2 || request->payload[1] < 1 || request->payload[1] > FRAME_MAX_PAYLOAD ||
+				request->payload[0] + request->payload[1] - 1 > 0xFF)
+			break;
+		am1815_read_bulk(&rtc, request->payload[0], response->payload, request->payload[1]);
+		response->size = request->payload[1];
+		return;
+	}
+	case FRAME_WRITE:
+	{
+		if (request->size < 2 || request->payload[0] + request->size - 2 > 0xFF)
+			break;
+		for (size_t i = 1; i < request->size; ++i)
+			rtc_cache_write(&cache, request->payload[0] + i - 1, request->payload[i]);
+		if (request->payload[0] <= 0x07)
+			clock_resync(&mcu_clock);
+		return;
+	}
+	case FRAME_EXIT:
+		return;
+	default:
+		response->opcode = FRAME_ERROR;
+		response->payload[0] = FRAME_ERROR_OPCODE;
+		response->size = 1;
+		return;
+	}
+	response->opcode = FRAME_ERROR;
+	response->payload[0] = FRAME_ERROR_ARGUMENT;
+	response->size = 1;
+}
+
+int command_binary(void *context, size_t argc, const char *argv[])
+{
+	(void)context;
+	(void)argc;
+	(void)argv;
+	printf("binary mode\r\n");
+	fflush(stdout);
+
+	struct frame_decoder decoder;
+	frame_decoder_init(&decoder);
+	struct frame request, response;
+	uint64_t ticks;
+	do
+	{
+		binary_read_frame(&decoder, &request, &ticks);
+		binary_handle(&decoder, &request, &response);
+		binary_write_frame(&response);
+	} while (request.opcode != FRAME_EXIT);
+
+	return 0;
+}
+
+// Must be kept sorted by command name (in strcmp order), as dispatch does a
+// binary search over it
 struct command commands[] = {
-	{ .command = "exit", .help = "Exit this application", .context = NULL, .function = command_exit},
 	{ .command = "?", .help = "Check the application name", .context = NULL, .function = command_name},
-	{ .command = "history", .help = "Get CLI history", .context = NULL, .function = command_history},
-	{ .command = "help", .help = "Get the list of commands, or help for a specific one", .context = NULL, .function = command_help},
+	{ .command = "alarm", .help = "Configure alarm", .context = &cache, .function = command_alarm},
+	{ .command = "binary", .help = "Switch to the binary framed protocol until an exit frame", .context = NULL, .function = command_binary},
+	{ .command = "cal_rc", .help = "Autocalibrate the RC oscillator and save the result, optionally keep it running every 512 or 1024 s", .context = &cache, .function = command_cal_rc},
+	{ .command = "cal_xt", .help = "Trim the XT oscillator by a correction in ppb, or report its calibration", .context = &cache, .function = command_cal_xt},
+	{ .command = "change_time", .help = "Change RTC time by an offset, at a hundredths rollover with adjust", .context = &mcu_clock, .function = command_change_time},
+	{ .command = "config", .help = "Report the boot config image check, or save the config to RTC RAM", .context = &cache, .function = command_config},
+	{ .command = "countdown", .help = "Configure countdown timer to (0, 15360]s", .context = &cache, .function = command_countdown},
+	{ .command = "diff", .help = "Print the registers changed since the last diff, or all of them with full", .context = &snapshot, .function = command_diff},
+	{ .command = "disable_pin", .help = "Disable default pins", .context = &cache, .function = command_disable_pin},
 	{ .command = "echo", .help = "Toggle console echo", .context = &cli, .function = command_echo},
+	{ .command = "exit", .help = "Exit this application", .context = NULL, .function = command_exit},
+	{ .command = "get_time", .help = "Get RTC's time", .context = &mcu_clock, .function = command_get_time},
+	{ .command = "help", .help = "Get the list of commands, or help for a specific one", .context = NULL, .function = command_help},
+	{ .command = "history", .help = "Get CLI history", .context = NULL, .function = command_history},
+	{ .command = "idle", .help = "Set how to wait for input (off, sleep, deep) and report wake latency", .context = NULL, .function = command_idle},
+	{ .command = "init", .help = "Init other stuff???????", .context = &cache, .function = command_init},
+	{ .command = "irq", .help = "Dispatch pending RTC interrupts and report edge to callback latency", .context = &irq, .function = command_irq},
+	{ .command = "log_dump", .help = "Print the event log kept in RTC RAM, oldest first", .context = &event_log, .function = command_log_dump},
+	{ .command = "osc_batover", .help = "Configure oscillator switchover on battery", .context = &cache, .function = command_osc_batover},
+	{ .command = "osc_failover", .help = "Configure oscillator failover", .context = &cache, .function = command_osc_failover},
+	{ .command = "ping", .help = "Get timestamps of request and response", .context = &mcu_clock, .function = command_ping},
+	{ .command = "ping_burst", .help = "Run N ping exchanges of one byte each way, then print all timestamps", .context = &mcu_clock, .function = command_ping_burst},
+	{ .command = "prog_osc", .help = "Default? program oscillator register", .context = &cache, .function = command_prog_osc},
 	{ .command = "read", .help = "Read a register", .context = &rtc, .function = command_read},
 	{ .command = "read_bulk", .help = "Read a series of registers", .context = &rtc, .function = command_read_bulk},
-	{ .command = "write", .help = "Write to a register", .context = &rtc, .function = command_write},
-	{ .command = "trickle", .help = "Control trickle charging", .context = &rtc, .function = command_trickle},
-	{ .command = "disable_pin", .help = "Disable default pins", .context = &rtc, .function = command_disable_pin},
-	{ .command = "prog_osc", .help = "Default? program oscillator register", .context = &rtc, .function = command_prog_osc},
-	{ .command = "osc_failover", .help = "Configure oscillator failover", .context = &rtc, .function = command_osc_failover},
-	{ .command = "osc_batover", .help = "Configure oscillator switchover on battery", .context = &rtc, .function = command_osc_batover},
-	{ .command = "alarm", .help = "Configure alarm", .context = &rtc, .function = command_alarm},
-	{ .command = "countdown", .help = "Configure countdown timer to (0, 15360]s", .context = &rtc, .function = command_countdown},
-	{ .command = "init", .help = "Init other stuff???????", .context = &rtc, .function = command_init},
-	{ .command = "get_time", .help = "Get RTC's time", .context = &rtc, .function = command_get_time},
-	{ .command = "set_time", .help = "Set RTC to a specified time", .context = &rtc, .function = command_set_time},
-	{ .command = "change_time", .help = "Change RTC time by an offset", .context = &rtc, .function = command_change_time},
-	{ .command = "ping", .help = "Get timestamps of request and response", .context = &rtc, .function = command_ping},
+	{ .command = "restore_rc", .help = "Program the RC calibration saved by cal_rc", .context = &cache, .function = command_restore_rc},
+	{ .command = "schedule", .help = "Schedule an event on the RTC alarm N seconds from now", .context = &alarms, .function = command_schedule},
+	{ .command = "set_time", .help = "Set RTC to a specified time", .context = &mcu_clock, .function = command_set_time},
+	{ .command = "set_time_at", .help = "Set RTC to a specified time at an instant given by the host", .context = &mcu_clock, .function = command_set_time_at},
+	{ .command = "spi_rate", .help = "Self-test the RTC SPI link at each clock and switch to the fastest reliable one", .context = &mcu_clock, .function = command_spi_rate},
+	{ .command = "stats", .help = "Print cycle histograms (count min p50 p99 max, percentiles rounded up to a power of two) of hot paths and commands, optionally reset", .context = NULL, .function = command_stats},
+	{ .command = "timer", .help = "Run the countdown timer with a period in s, options repeat/once, pulse/level, nirq/nirq2/none", .context = &cache, .function = command_timer},
+	{ .command = "trickle", .help = "Control trickle charging", .context = &cache, .function = command_trickle},
+	{ .command = "write", .help = "Write to a register", .context = &cache, .function = command_write},
 };
 
-int command_help(void *context, const char *line)
+// Cycles spent in each command handler, output included
+static struct stats_probe command_probes[ARRAY_SIZE(commands)];
+
+static int compare_command(const void *key, const void *element)
+{
+	const struct command *command = element;
+	return strcmp(key, command->command);
+}
+
+static const struct command *find_command(const char *name)
+{
+	return bsearch(name, commands, ARRAY_SIZE(commands), sizeof(*commands), compare_command);
+}
+
+static bool commands_sorted(void)
+{
+	for (size_t i = 1; i < ARRAY_SIZE(commands); ++i)
+	{
+		if (strcmp(commands[i-1].command, commands[i].command) >= 0)
+			return false;
+	}
+	return true;
+}
+
+int command_help(void *context, size_t argc, const char *argv[])
 {
 	(void)context;
-	(void)line;
+	if (argc > 1)
+	{
+		const struct command *command = find_command(argv[1]);
+		if (!command)
+			return -1;
+		printf("%s - %s\r\n", command->command, command->help);
+		return 0;
+	}
 	for (size_t i = 0; i < ARRAY_SIZE(commands); ++i)
 	{
 		printf("%s - %s\r\n", commands[i].command, commands[i].help);
@@ -620,53 +1498,109 @@ int command_help(void *context, const char *line)
 	return 0;
 }
 
-size_t get_ntokens(const char *str)
+static void print_stats(const char *name, struct stats_probe *probe, bool reset)
 {
-	char *tmp = malloc(strlen(str) + 1);
-	if (!tmp)
-		return ((size_t)0)-1; // FIXME what's a sensinble thing if we're out of memory?
-	memcpy(tmp, str, strlen(str) + 1);
-	size_t count = 0;
-	char *tok = strtok(tmp, " \t\r\n");
-	if (!tok)
-		return 0;
-	while (strtok(NULL, " \t\r\n"))
-		++count;
-	free(tmp);
-	return count;
+	struct stats_summary summary;
+	if (stats_summarize(probe, &summary))
+	{
+		printf("%s %lu %lu %lu %lu %lu\r\n", name, (unsigned long)summary.count,
+			(unsigned long)summary.min, (unsigned long)summary.p50,
+			(unsigned long)summary.p99, (unsigned long)summary.max);
+	}
+	if (reset)
+		stats_reset(probe);
 }
 
-int dispatch_command(const char *line)
+int command_stats(void *context, size_t argc, const char *argv[])
 {
-	char *buf = malloc(strlen(line)+1);
-	memcpy(buf, line, strlen(line)+1);
-	char *tok = strtok(buf, " \t\r\n");
-	int result = 0;
+	(void)context;
+	bool reset = argc > 1 && strcmp(argv[1], "reset") == 0;
+	if (argc > 1 && !reset)
+	{
+		printf("Error: invalid argument\r\n");
+		return -1;
+	}
+
+#ifdef RTC_STATS
+	// Cycles of the system clock, per probe: count min p50 p99 max. The
+	// percentiles are the upper bounds of power of two buckets, so they can be
+	// up to twice the real value.
+	printf("stats\r\n");
+	for (size_t i = 0; i < STATS_PROBES; ++i)
+		print_stats(stats_probe_names[i], &stats_probes[i], reset);
 	for (size_t i = 0; i < ARRAY_SIZE(commands); ++i)
+		print_stats(commands[i].command, &command_probes[i], reset);
+	printf("end\r\n");
+#else
+	(void)print_stats;
+	printf("Error: built without stats\r\n");
+#endif
+
+	return 0;
+}
+
+// Split line in place into at most MAX_ARGS whitespace separated arguments.
+// Returns the number of arguments, or MAX_ARGS + 1 if there were too many.
+static size_t tokenize(char *line, const char *argv[])
+{
+	size_t argc = 0;
+	for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n"))
 	{
-		const char *command = commands[i].command;
-		if (strcmp(command, tok) == 0)
-		{
-			if (commands[i].function)
-				result = commands[i].function(commands[i].context, line);
-			break;
-		}
+		if (argc == MAX_ARGS)
+			return MAX_ARGS + 1;
+		argv[argc++] = tok;
 	}
-	free(buf);
+	return argc;
+}
+
+int dispatch_command(const char *line)
+{
+	// Tokenize a copy, as the line buffer is also the CLI history entry. This
+	// and argv live on the stack, so nothing on the command path allocates.
+	char buf[sizeof(cli_line_buffer)];
+	const char *end = memchr(line, '\0', sizeof(buf) - 1);
+	size_t length = end ? (size_t)(end - line) : sizeof(buf) - 1;
+	memcpy(buf, line, length);
+	buf[length] = '\0';
+
+	const char *argv[MAX_ARGS];
+	size_t argc = tokenize(buf, argv);
+	if (argc == 0)
+		return 0;
+	if (argc > MAX_ARGS)
+	{
+		printf("Error: too many arguments\r\n");
+		return -1;
+	}
+
+	const struct command *command = find_command(argv[0]);
+	if (!command || !command->function)
+		return 0;
+	uint32_t start = stats_start();
+	int result = command->function(command->context, argc, argv);
+	stats_record(&command_probes[command - commands], start);
 	return result;
 }
 
 int main(void)
 {
+	assert(commands_sorted());
 	bool done = false;
 
 	while (!done)
 	{
+		// Keep the clock anchored while waiting for commands, so time
+		// requests don't have to
+		clock_service(&mcu_clock);
+		// Run the callbacks of RTC interrupts that came in since the last
+		// command
+		irq_service(&irq);
 		if (cli.echo)
 		{
 			printf("> ");
 			fflush(stdout);
 		}
+		idle_wait_input();
 		cli_line_buffer* buf = cli_read_line(&cli);
 		int result = dispatch_command((const char*)buf);
 
@@ -1,45 +1,316 @@
 // SPDX-License-Identifier: Apache-2.0
 // SPDX-FileCopyrightText: Gabriel Marcano, 2023
 
-#include <cli.h>
+#include <rtc.h>
+
+#include <frame.h>
+
 #include <am1815.h>
 
+#include <sys/time.h>
+
+#include <time.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
-// disable unused pins (i.e., all pins except SPI and VBAT)
-void disable_pins(struct am1815 *rtc){
+// Registers in the cached range whose contents change on their own or that
+// can't be read back, so they are never cached
+static bool is_volatile(uint8_t addr)
+{
+    switch (addr)
+    {
+    case 0x17: // Sleep Control, SLP self-clears
+    case 0x19: // Countdown Timer, counts down
+    case 0x1D: // Oscillator Status
+    case 0x1F: // Configuration Key, reads as zero
+    case 0x2F: // Analog Status
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_cacheable(uint8_t addr)
+{
+    return addr >= RTC_CACHE_FIRST && addr < RTC_CACHE_END && !is_volatile(addr);
+}
+
+// Configuration key value that unlocks writes to the given register, or 0 if
+// the register is not protected
+static uint8_t required_key(uint8_t addr)
+{
+    switch (addr)
+    {
+    case 0x1C:
+        return 0xA1;
+    case 0x20:
+    case 0x21:
+    case 0x26:
+    case 0x27:
+    case 0x30:
+        return 0x9D;
+    default:
+        return 0;
+    }
+}
+
+static uint64_t cache_bit(uint8_t addr)
+{
+    return 1ull << (addr - RTC_CACHE_FIRST);
+}
+
+// Mark every cacheable register valid, once registers holds all of them
+static void cache_validate(struct rtc_cache *cache)
+{
+    cache->valid = 0;
+    for (uint8_t addr = RTC_CACHE_FIRST; addr < RTC_CACHE_END; ++addr)
+    {
+        if (is_cacheable(addr))
+            cache->valid |= cache_bit(addr);
+    }
+}
+
+void rtc_cache_init(struct rtc_cache *cache, struct am1815 *rtc)
+{
+    cache->rtc = rtc;
+    cache->key = 0;
+    am1815_read_bulk(rtc, RTC_CACHE_FIRST, cache->registers, sizeof(cache->registers));
+    cache_validate(cache);
+}
+
+uint8_t rtc_cache_read(struct rtc_cache *cache, uint8_t addr)
+{
+    if (!is_cacheable(addr))
+        return am1815_read_register(cache->rtc, addr);
+
+    uint8_t *reg = &cache->registers[addr - RTC_CACHE_FIRST];
+    if (!(cache->valid & cache_bit(addr)))
+    {
+        *reg = am1815_read_register(cache->rtc, addr);
+        cache->valid |= cache_bit(addr);
+    }
+    return *reg;
+}
+
+void rtc_cache_write(struct rtc_cache *cache, uint8_t addr, uint8_t data)
+{
+    am1815_write_register(cache->rtc, addr, data);
+
+    if (addr == 0x1F)
+    {
+        cache->key = data;
+        return;
+    }
+
+    // The RTC drops writes to protected registers without the right key, and
+    // consumes the key on the ones it accepts
+    uint8_t key = required_key(addr);
+    bool accepted = !key || key == cache->key;
+    if (key)
+        cache->key = 0;
+
+    if (!is_cacheable(addr))
+        return;
+    if (accepted)
+    {
+        cache->registers[addr - RTC_CACHE_FIRST] = data;
+        cache->valid |= cache_bit(addr);
+    }
+    else
+    {
+        cache->valid &= ~cache_bit(addr);
+    }
+}
+
+void rtc_cache_update(struct rtc_cache *cache, uint8_t addr, uint8_t clear, uint8_t set)
+{
+    uint8_t data = rtc_cache_read(cache, addr);
+    rtc_cache_write(cache, addr, (data & ~clear) | set);
+}
+
+void rtc_cache_invalidate(struct rtc_cache *cache, uint8_t addr, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        uint8_t reg = addr + i;
+        if (reg >= RTC_CACHE_FIRST && reg < RTC_CACHE_END)
+            cache->valid &= ~cache_bit(reg);
+    }
+}
+
+static uint64_t transaction_bit(uint8_t addr)
+{
+    return 1ull << addr;
+}
+
+void rtc_transaction_begin(struct rtc_transaction *tx, struct rtc_cache *cache)
+{
+    tx->cache = cache;
+    tx->dirty = 0;
+    // Only staged registers are ever read, but the compiler can't see that
+    // through the dirty mask and warns at -O2
+    memset(tx->registers, 0, sizeof(tx->registers));
+}
+
+uint8_t rtc_transaction_read(struct rtc_transaction *tx, uint8_t addr)
+{
+    if (tx->dirty & transaction_bit(addr))
+        return tx->registers[addr];
+    return rtc_cache_read(tx->cache, addr);
+}
+
+void rtc_transaction_write(struct rtc_transaction *tx, uint8_t addr, uint8_t data)
+{
+    tx->registers[addr] = data;
+    tx->dirty |= transaction_bit(addr);
+}
+
+void rtc_transaction_update(struct rtc_transaction *tx, uint8_t addr, uint8_t clear, uint8_t set)
+{
+    uint8_t data = rtc_transaction_read(tx, addr);
+    rtc_transaction_write(tx, addr, (data & ~clear) | set);
+}
+
+static bool is_cached(const struct rtc_cache *cache, uint8_t addr)
+{
+    return is_cacheable(addr) && (cache->valid & cache_bit(addr));
+}
+
+// Whether a register has a staged value that differs from the RTC's
+static bool needs_write(const struct rtc_transaction *tx, uint8_t addr)
+{
+    if (!(tx->dirty & transaction_bit(addr)))
+        return false;
+    const struct rtc_cache *cache = tx->cache;
+    return !is_cached(cache, addr) ||
+        cache->registers[addr - RTC_CACHE_FIRST] != tx->registers[addr];
+}
+
+// Whether a register can be rewritten with its current value as filler in a
+// burst
+static bool is_filler(const struct rtc_transaction *tx, uint8_t addr)
+{
+    return is_cached(tx->cache, addr) && !required_key(addr) && !needs_write(tx, addr);
+}
+
+static void store(struct rtc_cache *cache, uint8_t addr, uint8_t data)
+{
+    if (is_cacheable(addr))
+    {
+        cache->registers[addr - RTC_CACHE_FIRST] = data;
+        cache->valid |= cache_bit(addr);
+    }
+}
+
+size_t rtc_transaction_commit(struct rtc_transaction *tx)
+{
+    struct rtc_cache *cache = tx->cache;
+    size_t bursts = 0;
+    uint8_t addr = 0;
+    while (addr < RTC_TRANSACTION_END)
+    {
+        if (!needs_write(tx, addr))
+        {
+            ++addr;
+            continue;
+        }
+
+        // Protected registers get their own key write right before them. The
+        // trickle register follows the key register, so both fit in a burst.
+        uint8_t key = required_key(addr);
+        if (key)
+        {
+            if (addr == 0x20)
+            {
+                uint8_t burst[2] = { key, tx->registers[addr] };
+                am1815_write_bulk(cache->rtc, 0x1F, burst, sizeof(burst));
+                bursts += 1;
+            }
+            else
+            {
+                am1815_write_register(cache->rtc, 0x1F, key);
+                am1815_write_register(cache->rtc, addr, tx->registers[addr]);
+                bursts += 2;
+            }
+            store(cache, addr, tx->registers[addr]);
+            ++addr;
+            continue;
+        }
+
+        // Extend the burst over following registers that need writing,
+        // bridging short gaps of registers whose values are known
+        uint8_t end = addr;
+        uint8_t gap = 0;
+        for (uint8_t next = addr + 1; next < RTC_TRANSACTION_END && gap <= RTC_TRANSACTION_MAX_GAP; ++next)
+        {
+            if (needs_write(tx, next) && !required_key(next))
+            {
+                end = next;
+                gap = 0;
+            }
+            else if (is_filler(tx, next))
+            {
+                ++gap;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        uint8_t burst[RTC_TRANSACTION_END];
+        size_t size = end - addr + 1;
+        for (size_t i = 0; i < size; ++i)
+        {
+            uint8_t reg = addr + i;
+            burst[i] = (tx->dirty & transaction_bit(reg)) ?
+                tx->registers[reg] : cache->registers[reg - RTC_CACHE_FIRST];
+            store(cache, reg, burst[i]);
+        }
+        am1815_write_bulk(cache->rtc, addr, burst, size);
+        bursts += 1;
+        addr = end + 1;
+    }
+
+    // Any key written before the transaction was consumed or overwritten
+    cache->key = 0;
+    tx->dirty = 0;
+    return bursts;
+}
+
+static void stage_disable_pins(struct rtc_transaction *tx)
+{
     // disable EXBM, WDBM, RSEN, O4EN, O3EN, O1EN
-    uint8_t read = am1815_read_register(rtc, 0x30);
     uint8_t mask = 0b11001111;
-    uint8_t result = read & ~mask;
-    am1815_write_register(rtc, 0x30, result);
+    rtc_transaction_update(tx, 0x30, mask, 0);
 
     // disable O4BM
-    uint8_t O4BM = am1815_read_register(rtc, 0x3F);
     uint8_t O4BMmask = 0b10000000;
-    uint8_t O4BMresult = O4BM & ~O4BMmask;
-    am1815_write_register(rtc, 0x3F, O4BMresult);
-
-    // get access to BATMODE I/O register
-    am1815_write_register(rtc, 0x1F, 0x9D);
+    rtc_transaction_update(tx, 0x3F, O4BMmask, 0);
 
     // disable SPI when we lose Vcc
     // set the BATMODE I/O register's 7th bit to 0
     // which means that the RTC will disable I/O interface in absence of vcc
-    uint8_t IOBM = am1815_read_register(rtc, 0x27);
+    // The commit takes care of unlocking the BATMODE I/O register
     uint8_t IOBMmask = 0b10000000;
-    uint8_t IOBMresult = IOBM & ~IOBMmask;
-    am1815_write_register(rtc, 0x27, IOBMresult);
+    rtc_transaction_update(tx, 0x27, IOBMmask, 0);
 }
 
-// Set up registers that control the alarm
-void configure_alarm(struct am1815 *rtc, bool enable, uint8_t pulse)
+// disable unused pins (i.e., all pins except SPI and VBAT)
+void disable_pins(struct rtc_cache *cache){
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+    stage_disable_pins(&tx);
+    rtc_transaction_commit(&tx);
+}
+
+static void stage_alarm(struct rtc_transaction *tx, bool enable, uint8_t pulse)
 {
     // Configure AIRQ (alarm) interrupt
     // IM (level/pulse) AIE (enables interrupt) 0x12 intmask
-    uint8_t alarm = am1815_read_register(rtc, 0x12);
+    uint8_t alarm = rtc_transaction_read(tx, 0x12);
     alarm = alarm & ~(0b01100100);
 
     // Enable/Disable the alarm
@@ -48,7 +319,7 @@ void configure_alarm(struct am1815 *rtc, bool enable, uint8_t pulse)
     }
     else{
         printf("alarm disabled\r\n");
-        am1815_write_register(rtc, 0x12, alarm);
+        rtc_transaction_write(tx, 0x12, alarm);
         return;
     }
 
@@ -64,34 +335,739 @@ void configure_alarm(struct am1815 *rtc, bool enable, uint8_t pulse)
     alarmMask += 0b00000100;
 
     uint8_t alarmResult = alarm | alarmMask;
-    am1815_write_register(rtc, 0x12, alarmResult);
+    rtc_transaction_write(tx, 0x12, alarmResult);
 
     // Set Control2 register bits so that FOUT/nIRQ pin outputs nAIRQ
-    uint8_t out = am1815_read_register(rtc, 0x11);
     uint8_t outMask = 0b00000011;
-    uint8_t outResult = out | outMask;
-    am1815_write_register(rtc, 0x11, outResult);
+    rtc_transaction_update(tx, 0x11, 0, outMask);
 
     // Set RPT bits in Countdown Timer Control register to control how often the alarm interrupt
     // repeats. Set it to 7 for now (once a second if hundredths alarm register contains 0)
-    uint8_t timerControl = am1815_read_register(rtc, 0x18);
     uint8_t timerMask = 0b00011100;
-    uint8_t timerResult = timerControl | timerMask;
-    am1815_write_register(rtc, 0x18, timerResult);
+    rtc_transaction_update(tx, 0x18, 0, timerMask);
+}
+
+// Set up registers that control the alarm
+void configure_alarm(struct rtc_cache *cache, bool enable, uint8_t pulse)
+{
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+    stage_alarm(&tx, enable, pulse);
+    rtc_transaction_commit(&tx);
 }
 
 // Set up registers that control the countdown timer
-void configure_countdown(struct am1815 *rtc, double timer) {
-    double period = am1815_write_timer(rtc, timer);
-    
+void configure_countdown(struct rtc_cache *cache, double timer) {
+    double period = am1815_write_timer(cache->rtc, timer);
+    // The driver programs the timer registers directly
+    rtc_cache_invalidate(cache, 0x18, 3);
+
     if (period == 0) {
         // Disable the countdown timer
-		uint8_t countdownTimer = am1815_read_register(rtc, 0x18);
-		am1815_write_register(rtc, 0x18, countdownTimer & ~0b10000000);
+        struct rtc_transaction tx;
+        rtc_transaction_begin(&tx, cache);
+        rtc_transaction_update(&tx, 0x18, 0b10000000, 0);
+        rtc_transaction_commit(&tx);
         printf("Timer disabled (input is 0 or too close to 0).\r\n");
     } else {
         printf("Timer set to %f seconds.\r\n", period);
     }
 }
 
+uint32_t rtc_timer_period(uint32_t period, uint8_t *tfs, uint16_t *count)
+{
+    // Timer tick length of each clock selection, fastest first: 4096 Hz,
+    // 64 Hz, 1 Hz, and 1/60 Hz
+    static const uint32_t ticks[] = {
+        1,
+        RTC_TIMER_TICKS_PER_SECOND / 64,
+        RTC_TIMER_TICKS_PER_SECOND,
+        RTC_TIMER_TICKS_PER_SECOND * 60,
+    };
+
+    if (!period || period > RTC_TIMER_MAX_PERIOD)
+        return 0;
+    for (uint8_t i = 0; i < sizeof(ticks) / sizeof(*ticks); ++i)
+    {
+        uint32_t steps = (period + ticks[i] / 2) / ticks[i];
+        if (steps > 256)
+            continue;
+        if (steps < 1)
+            steps = 1;
+        *tfs = i;
+        *count = steps;
+        return steps * ticks[i];
+    }
+    return 0;
+}
+
+uint32_t configure_periodic_timer(struct rtc_cache *cache, const struct rtc_timer_config *config)
+{
+    uint8_t tfs;
+    uint16_t count;
+    uint32_t period = rtc_timer_period(config->period, &tfs, &count);
+
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+    if (!period)
+    {
+        // Stop the timer (TE) and its interrupt (TIE)
+        rtc_transaction_update(&tx, 0x18, 0b10000000, 0);
+        rtc_transaction_update(&tx, 0x12, 0b00001000, 0);
+        rtc_transaction_commit(&tx);
+        return 0;
+    }
+
+    // Output selection, OUT1S = 0 puts nIRQ on FOUT/nIRQ and OUT2S = 5 puts
+    // nTIRQ on PSW/nIRQ2
+    if (config->output == RTC_TIMER_OUTPUT_NIRQ)
+        rtc_transaction_update(&tx, 0x11, 0b00000011, 0);
+    else if (config->output == RTC_TIMER_OUTPUT_NIRQ2)
+        rtc_transaction_update(&tx, 0x11, 0b00011100, 5 << 2);
+    // TIE
+    rtc_transaction_update(&tx, 0x12, 0, 0b00001000);
+
+    // The timer is stopped while it is reprogrammed, and started in a write
+    // of its own once the count and settings are in place. The count
+    // register and its reload value both get count - 1.
+    uint8_t control = rtc_transaction_read(&tx, 0x18) & 0b00011100;
+    control |= (config->pulse ? 0b01000000 : 0) | (config->repeat ? 0b00100000 : 0) | tfs;
+    rtc_transaction_write(&tx, 0x18, control);
+    rtc_transaction_write(&tx, 0x19, count - 1);
+    rtc_transaction_write(&tx, 0x1A, count - 1);
+    rtc_transaction_commit(&tx);
+
+    rtc_cache_update(cache, 0x18, 0, 0b10000000);
+    return period;
+}
+
+// Divide rounding to the nearest integer, halves away from zero
+static int64_t div_round(int64_t numerator, int64_t denominator)
+{
+    if ((numerator < 0) != (denominator < 0))
+        return (numerator - denominator / 2) / denominator;
+    return (numerator + denominator / 2) / denominator;
+}
+
+int64_t xt_calibration_ppb(const struct xt_calibration *cal)
+{
+    int64_t steps = cal->offsetx;
+    if (cal->cmdx)
+        steps = 2 * steps - 64 * cal->xtcal;
+    return div_round(steps * 1000000000, 1 << 19);
+}
+
+bool xt_calibration_from_ppb(int64_t ppb, struct xt_calibration *cal)
+{
+    if (ppb < XT_CALIBRATION_MIN_PPB || ppb > XT_CALIBRATION_MAX_PPB)
+        return false;
+
+    // Follows the calibration procedure in the AM18x5 datasheet, but rounds
+    // instead of truncating. Small adjustments use single steps, larger ones
+    // double steps, with XTCAL taking away 64 steps at a time.
+    int64_t steps = div_round(ppb * (1 << 19), 1000000000);
+    cal->xtcal = 0;
+    cal->cmdx = steps < -64 || steps > 63;
+    if (!cal->cmdx)
+    {
+        cal->offsetx = steps;
+        return true;
+    }
+    if (steps < -256)
+        cal->xtcal = 3;
+    else if (steps < -192)
+        cal->xtcal = 2;
+    else if (steps < -128)
+        cal->xtcal = 1;
+    int64_t offsetx = div_round(ppb * (1 << 18) + 32 * cal->xtcal * 1000000000ll, 1000000000);
+    if (offsetx > 63)
+        offsetx = 63;
+    if (offsetx < -64)
+        offsetx = -64;
+    cal->offsetx = offsetx;
+    return true;
+}
+
+void read_xt_calibration(struct rtc_cache *cache, struct xt_calibration *cal)
+{
+    uint8_t cal_xt = rtc_cache_read(cache, 0x14);
+    cal->cmdx = cal_xt & 0x80;
+    // OFFSETX is a 7 bit two's complement number
+    cal->offsetx = (int8_t)(cal_xt << 1) >> 1;
+    cal->xtcal = rtc_cache_read(cache, 0x1D) >> 6;
+}
+
+void configure_xt_calibration(struct rtc_cache *cache, const struct xt_calibration *cal)
+{
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+    rtc_transaction_write(&tx, 0x14, (cal->cmdx ? 0x80 : 0) | (cal->offsetx & 0x7F));
+
+    // Oscillator Status also holds the OF and ACF flags, which are only
+    // cleared by writing 0, so write back what was read unless XTCAL changes
+    uint8_t status = rtc_transaction_read(&tx, 0x1D);
+    if ((status >> 6) != cal->xtcal)
+        rtc_transaction_write(&tx, 0x1D, (status & 0x3F) | cal->xtcal << 6);
+    rtc_transaction_commit(&tx);
+}
+
+void configure_autocalibration(struct rtc_cache *cache, uint8_t acal)
+{
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+    // A stale ACF would make the new calibration look like it failed
+    if (acal != RTC_ACAL_OFF)
+        rtc_transaction_update(&tx, 0x1D, 0b00000001, 0);
+    rtc_transaction_update(&tx, 0x1C, 0b01100000, acal << 5);
+    rtc_transaction_commit(&tx);
+}
+
+bool read_rc_calibration(struct rtc_cache *cache, struct rc_calibration *cal)
+{
+    // Autocalibration changes the registers behind the cache's back
+    rtc_cache_invalidate(cache, 0x15, 2);
+    cal->hi = rtc_cache_read(cache, 0x15);
+    cal->lo = rtc_cache_read(cache, 0x16);
+    return !(rtc_cache_read(cache, 0x1D) & 0b00000001);
+}
+
+void configure_rc_calibration(struct rtc_cache *cache, const struct rc_calibration *cal)
+{
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+    rtc_transaction_write(&tx, 0x15, cal->hi);
+    rtc_transaction_write(&tx, 0x16, cal->lo);
+    rtc_transaction_commit(&tx);
+}
 
+// Mark the RTC as initialized by this program and apply the default alarm and
+// output configuration
+void initialize_rtc(struct rtc_cache *cache)
+{
+    // Everything is staged and then committed together, so the whole sequence
+    // takes as few SPI bursts as possible
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+
+    // Write to bit 7 of register 1 to signal that this program initialized the RTC
+    // The seconds register is a time register, so this is always a real read
+    uint8_t secMask = 0b10000000;
+    rtc_transaction_update(&tx, 0x01, 0, secMask);
+    stage_alarm(&tx, true, 1);
+
+    rtc_transaction_write(&tx, 0x30, 0x01);
+    rtc_transaction_commit(&tx);
+}
+
+// Registers kept in the configuration image: control, interrupt and output
+// setup, XT calibration, countdown timer, and power switching. The Oscillator
+// Status (0x1D) XTCAL bits are left out, it also holds status flags. So is
+// Cal_RC (0x15, 0x16), which autocalibration keeps changing and which has its
+// own record for restore_rc.
+static const uint8_t config_registers[] = {
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x18, 0x1A, 0x1C, 0x20, 0x21, 0x27, 0x30,
+};
+
+#define CONFIG_MAGIC_0 'R'
+#define CONFIG_MAGIC_1 'C'
+
+// Image layout: magic (2), version (1), register count (1), register values,
+// CRC16 (2, BE) of everything before it
+#define CONFIG_HEADER 4
+#define CONFIG_IMAGE_SIZE (CONFIG_HEADER + sizeof(config_registers) + 2)
+
+_Static_assert(CONFIG_IMAGE_SIZE <= RTC_CONFIG_SIZE, "configuration image too large");
+
+static bool config_image_valid(const uint8_t *image)
+{
+    return image[0] == CONFIG_MAGIC_0 && image[1] == CONFIG_MAGIC_1 &&
+        image[2] == RTC_CONFIG_VERSION && image[3] == sizeof(config_registers) &&
+        frame_crc16(0, image, CONFIG_IMAGE_SIZE) == 0;
+}
+
+enum rtc_config_status rtc_config_init(struct rtc_cache *cache, struct am1815 *rtc)
+{
+    // The cached registers and the image are adjacent, so one burst reads both
+    uint8_t data[RTC_CONFIG_ADDR + RTC_CONFIG_SIZE - RTC_CACHE_FIRST];
+    am1815_read_bulk(rtc, RTC_CACHE_FIRST, data, sizeof(data));
+
+    cache->rtc = rtc;
+    cache->key = 0;
+    memcpy(cache->registers, data, sizeof(cache->registers));
+    cache_validate(cache);
+
+    const uint8_t *image = &data[RTC_CONFIG_ADDR - RTC_CACHE_FIRST];
+    if (!config_image_valid(image))
+        return RTC_CONFIG_MISSING;
+
+    // Registers that already hold their stored value are dropped by the
+    // commit, so a warm boot writes nothing
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+    for (size_t i = 0; i < sizeof(config_registers); ++i)
+        rtc_transaction_write(&tx, config_registers[i], image[CONFIG_HEADER + i]);
+    return rtc_transaction_commit(&tx) ? RTC_CONFIG_RESTORED : RTC_CONFIG_MATCH;
+}
+
+void rtc_config_save(struct rtc_cache *cache)
+{
+    uint8_t image[CONFIG_IMAGE_SIZE];
+    image[0] = CONFIG_MAGIC_0;
+    image[1] = CONFIG_MAGIC_1;
+    image[2] = RTC_CONFIG_VERSION;
+    image[3] = sizeof(config_registers);
+    for (size_t i = 0; i < sizeof(config_registers); ++i)
+        image[CONFIG_HEADER + i] = rtc_cache_read(cache, config_registers[i]);
+    uint16_t crc = frame_crc16(0, image, CONFIG_IMAGE_SIZE - 2);
+    image[CONFIG_IMAGE_SIZE - 2] = crc >> 8;
+    image[CONFIG_IMAGE_SIZE - 1] = crc & 0xFF;
+    am1815_write_bulk(cache->rtc, RTC_CONFIG_ADDR, image, sizeof(image));
+}
+
+#define RC_CALIBRATION_MAGIC_0 'R'
+#define RC_CALIBRATION_MAGIC_1 'K'
+
+// Record layout: magic (2), Cal_RC high and low (2), CRC16 (2, BE) of
+// everything before it
+#define RC_CALIBRATION_SIZE 6
+
+_Static_assert(RTC_CONFIG_ADDR + CONFIG_IMAGE_SIZE <= RTC_RC_CALIBRATION_ADDR,
+    "RC calibration overlaps the configuration image");
+_Static_assert(RTC_RC_CALIBRATION_ADDR + RC_CALIBRATION_SIZE <= RTC_CONFIG_ADDR + RTC_CONFIG_SIZE,
+    "RC calibration outside the configuration area");
+
+void rtc_rc_calibration_save(struct rtc_cache *cache, const struct rc_calibration *cal)
+{
+    uint8_t record[RC_CALIBRATION_SIZE] = {
+        RC_CALIBRATION_MAGIC_0, RC_CALIBRATION_MAGIC_1, cal->hi, cal->lo,
+    };
+    uint16_t crc = frame_crc16(0, record, RC_CALIBRATION_SIZE - 2);
+    record[RC_CALIBRATION_SIZE - 2] = crc >> 8;
+    record[RC_CALIBRATION_SIZE - 1] = crc & 0xFF;
+    am1815_write_bulk(cache->rtc, RTC_RC_CALIBRATION_ADDR, record, sizeof(record));
+}
+
+bool rtc_rc_calibration_load(struct rtc_cache *cache, struct rc_calibration *cal)
+{
+    uint8_t record[RC_CALIBRATION_SIZE];
+    am1815_read_bulk(cache->rtc, RTC_RC_CALIBRATION_ADDR, record, sizeof(record));
+    if (record[0] != RC_CALIBRATION_MAGIC_0 || record[1] != RC_CALIBRATION_MAGIC_1 ||
+            frame_crc16(0, record, RC_CALIBRATION_SIZE) != 0)
+        return false;
+    cal->hi = record[2];
+    cal->lo = record[3];
+    return true;
+}
+
+static uint8_t to_bcd(unsigned value)
+{
+    return (value / 10) << 4 | value % 10;
+}
+
+static bool timeval_before(const struct timeval *a, const struct timeval *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+void rtc_alarm_init(struct rtc_alarm_scheduler *scheduler, struct rtc_cache *cache)
+{
+    scheduler->cache = cache;
+    scheduler->count = 0;
+    scheduler->is_armed = false;
+}
+
+// Take the events due at now off the queue and run them, so callbacks can
+// schedule new ones. Returns the number of callbacks run.
+static size_t rtc_alarm_run_due(struct rtc_alarm_scheduler *scheduler, const struct timeval *now)
+{
+    struct rtc_alarm_event due[RTC_ALARM_MAX_EVENTS];
+    size_t count = 0;
+    while (count < scheduler->count && !timeval_before(now, &scheduler->events[count].deadline))
+    {
+        due[count] = scheduler->events[count];
+        ++count;
+    }
+    scheduler->count -= count;
+    memmove(scheduler->events, scheduler->events + count, scheduler->count * sizeof(*scheduler->events));
+
+    for (size_t i = 0; i < count; ++i)
+        due[i].callback(due[i].context);
+    return count;
+}
+
+// Program the alarm for the earliest event, or disable it if there is none.
+// Returns false if the event's deadline had already come by the time the
+// alarm was written, with the RTC time read then in now.
+static bool rtc_alarm_arm(struct rtc_alarm_scheduler *scheduler, struct timeval *now)
+{
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, scheduler->cache);
+
+    if (!scheduler->count)
+    {
+        // RPT = 0 disables the alarm
+        rtc_transaction_update(&tx, 0x18, 0b00011100, 0);
+        rtc_transaction_commit(&tx);
+        scheduler->is_armed = false;
+        return true;
+    }
+
+    const struct timeval *deadline = &scheduler->events[0].deadline;
+    if (scheduler->is_armed && deadline->tv_sec == scheduler->armed.tv_sec &&
+            deadline->tv_usec == scheduler->armed.tv_usec)
+        return true;
+
+    // The alarm matches everything but the year, so a deadline more than a
+    // year out fires early, and service just arms it again
+    time_t seconds = deadline->tv_sec;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    rtc_transaction_write(&tx, 0x08, to_bcd(deadline->tv_usec / 10000));
+    rtc_transaction_write(&tx, 0x09, to_bcd(tm.tm_sec));
+    rtc_transaction_write(&tx, 0x0A, to_bcd(tm.tm_min));
+    rtc_transaction_write(&tx, 0x0B, to_bcd(tm.tm_hour));
+    rtc_transaction_write(&tx, 0x0C, to_bcd(tm.tm_mday));
+    rtc_transaction_write(&tx, 0x0D, to_bcd(tm.tm_mon + 1));
+    rtc_transaction_write(&tx, 0x0E, tm.tm_wday);
+
+    // Once the output, interrupt enable, and repeat are in place they are
+    // dropped from later commits as no-ops, leaving only the alarm burst.
+    // FOUT/nIRQ outputs nAIRQ.
+    rtc_transaction_update(&tx, 0x11, 0, 0b00000011);
+    rtc_transaction_update(&tx, 0x12, 0, 0b00000100);
+    rtc_transaction_update(&tx, 0x18, 0b00011100, 1 << 2);
+    rtc_transaction_commit(&tx);
+
+    scheduler->armed = *deadline;
+    scheduler->is_armed = true;
+
+    // The alarm only matches the exact time, so a deadline that has already
+    // come would not fire for another year
+    *now = am1815_read_time(scheduler->cache->rtc);
+    return timeval_before(now, deadline);
+}
+
+// Arm the alarm for the earliest event, running any events found due while
+// doing so
+static void rtc_alarm_update(struct rtc_alarm_scheduler *scheduler)
+{
+    struct timeval now;
+    while (!rtc_alarm_arm(scheduler, &now))
+        rtc_alarm_run_due(scheduler, &now);
+}
+
+bool rtc_alarm_schedule(struct rtc_alarm_scheduler *scheduler, const struct timeval *deadline,
+    void (*callback)(void *context), void *context)
+{
+    if (scheduler->count == RTC_ALARM_MAX_EVENTS)
+        return false;
+
+    // The alarm can't fire between hundredths, round up so it is never early
+    struct timeval rounded = *deadline;
+    rounded.tv_usec = (rounded.tv_usec + 9999) / 10000 * 10000;
+    if (rounded.tv_usec == 1000000)
+    {
+        rounded.tv_sec += 1;
+        rounded.tv_usec = 0;
+    }
+
+    // Insert after events with the same deadline, so they run in the order
+    // they were scheduled
+    size_t i = scheduler->count;
+    while (i > 0 && timeval_before(&rounded, &scheduler->events[i - 1].deadline))
+    {
+        scheduler->events[i] = scheduler->events[i - 1];
+        --i;
+    }
+    scheduler->events[i].deadline = rounded;
+    scheduler->events[i].callback = callback;
+    scheduler->events[i].context = context;
+    scheduler->count += 1;
+
+    if (i == 0)
+        rtc_alarm_update(scheduler);
+    return true;
+}
+
+size_t rtc_alarm_cancel(struct rtc_alarm_scheduler *scheduler,
+    void (*callback)(void *context), void *context)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < scheduler->count; ++i)
+    {
+        const struct rtc_alarm_event *event = &scheduler->events[i];
+        if (event->callback != callback || event->context != context)
+            scheduler->events[kept++] = *event;
+    }
+    size_t removed = scheduler->count - kept;
+    scheduler->count = kept;
+    if (removed)
+        rtc_alarm_update(scheduler);
+    return removed;
+}
+
+const struct timeval *rtc_alarm_next(const struct rtc_alarm_scheduler *scheduler)
+{
+    return scheduler->count ? &scheduler->events[0].deadline : NULL;
+}
+
+size_t rtc_alarm_service(struct rtc_alarm_scheduler *scheduler, const struct timeval *now)
+{
+    size_t count = rtc_alarm_run_due(scheduler, now);
+    rtc_alarm_update(scheduler);
+    return count;
+}
+
+void rtc_interrupts_init(struct rtc_interrupts *interrupts, struct rtc_cache *cache)
+{
+    interrupts->cache = cache;
+    interrupts->count = 0;
+    // ARST, reading the Status register clears its interrupt flags. It is
+    // part of the configuration image, so on a warm boot it is already set
+    // and the commit writes nothing.
+    struct rtc_transaction tx;
+    rtc_transaction_begin(&tx, cache);
+    rtc_transaction_update(&tx, 0x10, 0, 0b00000100);
+    rtc_transaction_commit(&tx);
+}
+
+bool rtc_interrupts_register(struct rtc_interrupts *interrupts, uint8_t flags,
+    void (*callback)(void *context, uint8_t status), void *context)
+{
+    if (interrupts->count == RTC_INTERRUPT_MAX_HANDLERS)
+        return false;
+    struct rtc_interrupt_handler *handler = &interrupts->handlers[interrupts->count++];
+    handler->flags = flags;
+    handler->callback = callback;
+    handler->context = context;
+    return true;
+}
+
+uint8_t rtc_interrupts_read(struct rtc_interrupts *interrupts)
+{
+    return am1815_read_register(interrupts->cache->rtc, 0x0F);
+}
+
+void rtc_interrupts_run(const struct rtc_interrupts *interrupts, uint8_t status)
+{
+    for (size_t i = 0; i < interrupts->count; ++i)
+    {
+        const struct rtc_interrupt_handler *handler = &interrupts->handlers[i];
+        if (handler->flags & status)
+            handler->callback(handler->context, status);
+    }
+}
+
+void rtc_snapshot_init(struct rtc_snapshot *snapshot, struct rtc_cache *cache)
+{
+    snapshot->cache = cache;
+    snapshot->has_previous = false;
+}
+
+uint64_t rtc_snapshot_take(struct rtc_snapshot *snapshot)
+{
+    memcpy(snapshot->previous, snapshot->registers, sizeof(snapshot->previous));
+    am1815_read_bulk(snapshot->cache->rtc, 0x00, snapshot->registers, sizeof(snapshot->registers));
+
+    // The burst covers the whole cached range, so the cache comes up to date
+    // for free
+    struct rtc_cache *cache = snapshot->cache;
+    memcpy(cache->registers, &snapshot->registers[RTC_CACHE_FIRST], sizeof(cache->registers));
+    cache_validate(cache);
+
+    uint64_t changed = 0;
+    for (size_t i = 0; i < RTC_SNAPSHOT_SIZE; ++i)
+    {
+        if (!snapshot->has_previous || snapshot->registers[i] != snapshot->previous[i])
+            changed |= 1ull << i;
+    }
+    snapshot->has_previous = true;
+    return changed;
+}
+
+#define LOG_MAGIC_0 'L'
+#define LOG_MAGIC_1 'G'
+
+static uint8_t *log_slot(uint8_t *data, size_t slot)
+{
+    return &data[RTC_LOG_HEADER + slot * RTC_LOG_RECORD_SIZE];
+}
+
+// Decode the log RAM contents into records, oldest first, returning how many
+// there are and the slot after the newest
+static size_t log_decode(uint8_t *data, struct rtc_log_record *records, size_t *next)
+{
+    // The newest record is the last one before an empty slot or a seq break
+    size_t newest = RTC_LOG_SLOTS;
+    for (size_t i = 0; i < RTC_LOG_SLOTS; ++i)
+    {
+        const uint8_t *slot = log_slot(data, i);
+        const uint8_t *after = log_slot(data, (i + 1) % RTC_LOG_SLOTS);
+        if (slot[1] != RTC_LOG_EMPTY &&
+                (after[1] == RTC_LOG_EMPTY || after[0] != (uint8_t)(slot[0] + 1)))
+        {
+            newest = i;
+            break;
+        }
+    }
+    if (newest == RTC_LOG_SLOTS)
+    {
+        *next = 0;
+        return 0;
+    }
+    *next = (newest + 1) % RTC_LOG_SLOTS;
+
+    // Unless the ring has wrapped, the records start at slot 0
+    size_t oldest = log_slot(data, *next)[1] == RTC_LOG_EMPTY ? 0 : *next;
+    size_t count = (newest + RTC_LOG_SLOTS - oldest) % RTC_LOG_SLOTS + 1;
+
+    // Forwards, epochs give the time of the event after them and deltas
+    // carry it on to the following events
+    uint16_t deltas[RTC_LOG_SLOTS];
+    bool epoch = false;
+    const struct rtc_log_record *previous = NULL;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint8_t *slot = log_slot(data, (oldest + i) % RTC_LOG_SLOTS);
+        struct rtc_log_record *record = &records[i];
+        record->seq = slot[0];
+        record->type = slot[1];
+        record->time_known = false;
+        if (record->type == RTC_LOG_EPOCH)
+        {
+            record->time = (int64_t)slot[2] << 24 | slot[3] << 16 | slot[4] << 8 | slot[5];
+            record->time_known = true;
+            record->data = 0;
+            epoch = true;
+            continue;
+        }
+
+        deltas[i] = slot[2] << 8 | slot[3];
+        record->data = (int16_t)(slot[4] << 8 | slot[5]);
+        if (epoch)
+        {
+            record->time = records[i - 1].time;
+            record->time_known = true;
+        }
+        else if (previous && previous->time_known && deltas[i] != RTC_LOG_NO_DELTA)
+        {
+            record->time = previous->time + deltas[i];
+            record->time_known = true;
+        }
+        epoch = false;
+        previous = record;
+    }
+
+    // Backwards, events before the oldest surviving epoch get their times
+    // from the deltas of the events after them
+    struct rtc_log_record *later = NULL;
+    for (size_t i = count; i-- > 0;)
+    {
+        struct rtc_log_record *record = &records[i];
+        if (record->type == RTC_LOG_EPOCH)
+            continue;
+        if (!record->time_known && later && later->time_known &&
+                deltas[later - records] != RTC_LOG_NO_DELTA)
+        {
+            record->time = later->time - deltas[later - records];
+            record->time_known = true;
+        }
+        later = record;
+    }
+    return count;
+}
+
+void rtc_log_init(struct rtc_log *log, struct rtc_cache *cache)
+{
+    log->cache = cache;
+    log->has_last = false;
+
+    uint8_t data[RTC_LOG_END - RTC_LOG_ADDR];
+    am1815_read_bulk(cache->rtc, RTC_LOG_ADDR, data, sizeof(data));
+    if (data[0] != LOG_MAGIC_0 || data[1] != LOG_MAGIC_1 ||
+            data[2] != RTC_LOG_VERSION || data[3] != RTC_LOG_SLOTS)
+    {
+        // The RAM lost power or holds something else, start an empty log
+        memset(data, 0, sizeof(data));
+        data[0] = LOG_MAGIC_0;
+        data[1] = LOG_MAGIC_1;
+        data[2] = RTC_LOG_VERSION;
+        data[3] = RTC_LOG_SLOTS;
+        am1815_write_bulk(cache->rtc, RTC_LOG_ADDR, data, sizeof(data));
+    }
+
+    struct rtc_log_record records[RTC_LOG_SLOTS];
+    log->count = log_decode(data, records, &log->next);
+    log->seq = 0;
+    // Without an epoch in the log the next append writes one
+    log->since_epoch = RTC_LOG_SLOTS;
+    for (size_t i = 0; i < log->count; ++i)
+    {
+        if (records[i].type == RTC_LOG_EPOCH)
+            log->since_epoch = 0;
+        else if (log->since_epoch < RTC_LOG_SLOTS)
+            log->since_epoch += 1;
+    }
+    if (log->count)
+    {
+        const struct rtc_log_record *newest = &records[log->count - 1];
+        log->seq = newest->seq + 1;
+        log->last = newest->time;
+        log->has_last = newest->time_known;
+    }
+}
+
+static void log_encode(uint8_t *slot, uint8_t seq, uint8_t type, uint32_t value)
+{
+    slot[0] = seq;
+    slot[1] = type;
+    slot[2] = value >> 24;
+    slot[3] = value >> 16;
+    slot[4] = value >> 8;
+    slot[5] = value;
+}
+
+void rtc_log_append(struct rtc_log *log, const struct timeval *now, uint8_t type, int16_t data)
+{
+    uint8_t records[2 * RTC_LOG_RECORD_SIZE];
+    size_t size = 0;
+
+    // An epoch goes in when the time can't be carried by a delta, and before
+    // the previous epoch could be overwritten, so the log always has one
+    int64_t delta = now->tv_sec - log->last;
+    bool fits = log->has_last && delta >= 0 && delta < RTC_LOG_NO_DELTA;
+    if (!fits || log->since_epoch >= RTC_LOG_SLOTS - 2)
+    {
+        log_encode(records, log->seq++, RTC_LOG_EPOCH, (uint32_t)now->tv_sec);
+        size += RTC_LOG_RECORD_SIZE;
+        log->since_epoch = 0;
+    }
+    uint16_t field = fits ? (uint16_t)delta : RTC_LOG_NO_DELTA;
+    log_encode(&records[size], log->seq++, type, (uint32_t)field << 16 | (uint16_t)data);
+    size += RTC_LOG_RECORD_SIZE;
+    log->since_epoch += 1;
+    log->last = now->tv_sec;
+    log->has_last = true;
+
+    // Split the burst where the records wrap around
+    size_t slots = size / RTC_LOG_RECORD_SIZE;
+    size_t first = RTC_LOG_SLOTS - log->next < slots ? RTC_LOG_SLOTS - log->next : slots;
+    uint8_t addr = RTC_LOG_ADDR + RTC_LOG_HEADER + log->next * RTC_LOG_RECORD_SIZE;
+    am1815_write_bulk(log->cache->rtc, addr, records, first * RTC_LOG_RECORD_SIZE);
+    if (first < slots)
+    {
+        am1815_write_bulk(log->cache->rtc, RTC_LOG_ADDR + RTC_LOG_HEADER,
+            &records[first * RTC_LOG_RECORD_SIZE], (slots - first) * RTC_LOG_RECORD_SIZE);
+    }
+
+    log->next = (log->next + slots) % RTC_LOG_SLOTS;
+    log->count = log->count + slots < RTC_LOG_SLOTS ? log->count + slots : RTC_LOG_SLOTS;
+}
+
+size_t rtc_log_read(struct rtc_log *log, struct rtc_log_record *records)
+{
+    uint8_t data[RTC_LOG_END - RTC_LOG_ADDR];
+    am1815_read_bulk(log->cache->rtc, RTC_LOG_ADDR, data, sizeof(data));
+    size_t next;
+    return log_decode(data, records, &next);
+}
@@ -59,4 +59,55 @@ def server_test_time(port, trials, ser):
     print("Standard Deviation: " + str(numpy.std(offsetAvg)))
     return toReturn
 
+def ping_burst(ser, trials):
+    """
+    Runs a single ping_burst command, where the device sends one marker byte
+    per exchange, answered with one byte, and prints all of its timestamps
+    once the burst is over. Trials is at most 100. Returns the offset of every
+    exchange in seconds, host minus RTC.
+    """
+    ser.reset_input_buffer()
+    ser.reset_output_buffer()
+
+    ser.write(bytearray(f"ping_burst {trials}\r\n", 'utf-8'))
+
+    line = ser.readline()
+    while line.decode('utf-8')[0:-2] != "burst":
+        line = ser.readline()
+
+    # Host timestamps of receiving each request and sending each response
+    received = []
+    sent = []
+    for x in range(trials):
+        while ser.read(1) != b'>':
+            pass
+        received.append(time.time())
+        ser.write(b'<')
+        sent.append(time.time())
+
+    # Device timestamps, in microseconds from its first request
+    count, baseSec, baseMicro = (int(v) for v in ser.readline().split())
+    base = baseSec + baseMicro / 1000000
+
+    offsets = []
+    for x in range(count):
+        request, response = (int(v) for v in ser.readline().split())
+        t0 = base + request / 1000000
+        t3 = base + response / 1000000
+        firstHalf = received[x] - t0
+        secondHalf = sent[x] - t3
+        offsets.append((firstHalf + secondHalf) / 2)
+    return offsets
+
+def server_test_time_burst(ser, trials):
+    """
+    Same estimate as server_test_time, from a single ping_burst command
+    """
+    offsets = ping_burst(ser, trials)
+
+    toReturn = sum(offsets) / len(offsets)
+    print("Average offset in seconds: " + str(toReturn))
+    print("Standard Deviation: " + str(numpy.std(offsets)))
+    return toReturn
+
 # server_test_time("/dev/ttyUSB1", 100)
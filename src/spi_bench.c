@@ -0,0 +1,324 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+// Host benchmark of the librtc helpers against the simulated AM1815. For each
+// helper it reports the SPI traffic of one call and the host wall-time per
+// call. With --check, it fails if any helper uses more SPI transactions than
+// its budget, has a write rejected by the RTC, or leaves the simulated
+// registers in the wrong state, so regressions are caught before reaching a
+// device.
+
+#include <rtc.h>
+
+#include <am1815.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#define ARRAY_SIZE(ARG) (sizeof(ARG)/sizeof(*ARG))
+#define ITERATIONS 10000
+
+static struct am1815 rtc;
+static struct rtc_cache cache;
+
+static void bench_rtc_cache_init(void)
+{
+	rtc_cache_init(&cache, &rtc);
+}
+
+// Every pin disable_pins turns off starts out on
+static void setup_disable_pins(void)
+{
+	struct rtc_transaction tx;
+	rtc_transaction_begin(&tx, &cache);
+	rtc_transaction_update(&tx, 0x30, 0, 0b11001111);
+	rtc_transaction_update(&tx, 0x3F, 0, 0b10000000);
+	rtc_transaction_update(&tx, 0x27, 0, 0b10000000);
+	rtc_transaction_commit(&tx);
+}
+
+static void bench_disable_pins(void)
+{
+	disable_pins(&cache);
+}
+
+static bool verify_disable_pins(void)
+{
+	return !(am1815_sim_peek(0x30) & 0b11001111) && !(am1815_sim_peek(0x3F) & 0b10000000) &&
+		!(am1815_sim_peek(0x27) & 0b10000000);
+}
+
+static void bench_configure_alarm(void)
+{
+	configure_alarm(&cache, true, 1);
+}
+
+static void bench_configure_countdown(void)
+{
+	configure_countdown(&cache, 10.);
+}
+
+static void bench_initialize_rtc(void)
+{
+	initialize_rtc(&cache);
+}
+
+// Initialized flag, FOUT/nIRQ as nAIRQ, pulsed alarm interrupt, RPT = 7, and
+// the output control set up
+static bool verify_initialize_rtc(void)
+{
+	return (am1815_sim_peek(0x01) & 0b10000000) &&
+		(am1815_sim_peek(0x11) & 0b00000011) == 0b00000011 &&
+		(am1815_sim_peek(0x12) & 0b01100100) == 0b00100100 &&
+		(am1815_sim_peek(0x18) & 0b00011100) == 0b00011100 &&
+		am1815_sim_peek(0x30) == 0x01;
+}
+
+static void bench_configure_periodic_timer(void)
+{
+	struct rtc_timer_config config = {
+		.period = 10 * RTC_TIMER_TICKS_PER_SECOND,
+		.repeat = true,
+		.pulse = true,
+		.output = RTC_TIMER_OUTPUT_NIRQ2,
+	};
+	configure_periodic_timer(&cache, &config);
+}
+
+static void bench_rtc_config_save(void)
+{
+	rtc_config_save(&cache);
+}
+
+// Warm reset, the registers match the saved image
+static void bench_rtc_config_init(void)
+{
+	rtc_config_init(&cache, &rtc);
+}
+
+// Cal_XT (0x14) value stored in the image by setup_rtc_config_restore
+#define CONFIG_XT_CALIBRATION 0x25
+
+// The image is saved, then a stored register and a protected one drift
+static void setup_rtc_config_restore(void)
+{
+	rtc_cache_write(&cache, 0x14, CONFIG_XT_CALIBRATION);
+	rtc_config_save(&cache);
+	struct rtc_transaction tx;
+	rtc_transaction_begin(&tx, &cache);
+	rtc_transaction_write(&tx, 0x14, 0x00);
+	rtc_transaction_update(&tx, 0x27, 0b10000000, 0);
+	rtc_transaction_commit(&tx);
+}
+
+static bool verify_rtc_config_restore(void)
+{
+	return am1815_sim_peek(0x14) == CONFIG_XT_CALIBRATION &&
+		(am1815_sim_peek(0x27) & 0b10000000);
+}
+
+static const struct rc_calibration rc_calibration = {.hi = 0x12, .lo = 0x34};
+
+static void bench_rtc_rc_calibration_save(void)
+{
+	rtc_rc_calibration_save(&cache, &rc_calibration);
+}
+
+static void bench_rtc_rc_calibration_load(void)
+{
+	struct rc_calibration cal;
+	rtc_rc_calibration_load(&cache, &cal);
+}
+
+static bool verify_rtc_rc_calibration_load(void)
+{
+	struct rc_calibration cal;
+	return rtc_rc_calibration_load(&cache, &cal) &&
+		cal.hi == rc_calibration.hi && cal.lo == rc_calibration.lo;
+}
+
+static const struct timeval alarm_base = {.tv_sec = 1700000000, .tv_usec = 0};
+
+static struct rtc_log event_log;
+
+static void setup_rtc_log(void)
+{
+	rtc_log_init(&event_log, &cache);
+}
+
+static void bench_rtc_log_append(void)
+{
+	rtc_log_append(&event_log, &alarm_base, RTC_LOG_TIME_STEP, 10);
+}
+
+static void bench_rtc_log_read(void)
+{
+	struct rtc_log_record records[RTC_LOG_SLOTS];
+	rtc_log_read(&event_log, records);
+}
+
+// The appended record reads back from user RAM with its time, after an epoch
+static bool verify_rtc_log_append(void)
+{
+	struct rtc_log log;
+	rtc_log_init(&log, &cache);
+	struct rtc_log_record records[RTC_LOG_SLOTS];
+	size_t count = rtc_log_read(&log, records);
+	if (count < 2)
+		return false;
+	const struct rtc_log_record *epoch = &records[0];
+	const struct rtc_log_record *record = &records[1];
+	return epoch->type == RTC_LOG_EPOCH && record->type == RTC_LOG_TIME_STEP &&
+		record->data == 10 && record->time_known && record->time == alarm_base.tv_sec;
+}
+
+static struct rtc_snapshot snapshot;
+
+static void setup_rtc_snapshot(void)
+{
+	rtc_snapshot_init(&snapshot, &cache);
+}
+
+static void bench_rtc_snapshot_take(void)
+{
+	rtc_snapshot_take(&snapshot);
+}
+
+static struct rtc_alarm_scheduler scheduler;
+
+static void alarm_event(void *context)
+{
+	(void)context;
+}
+
+static void bench_rtc_alarm_schedule(void)
+{
+	rtc_alarm_init(&scheduler, &cache);
+	rtc_alarm_schedule(&scheduler, &alarm_base, alarm_event, NULL);
+}
+
+// Two events pending, the first of them armed
+static void setup_rtc_alarm_service(void)
+{
+	rtc_alarm_init(&scheduler, &cache);
+	struct timeval later = {.tv_sec = alarm_base.tv_sec + 1, .tv_usec = 0};
+	rtc_alarm_schedule(&scheduler, &alarm_base, alarm_event, NULL);
+	rtc_alarm_schedule(&scheduler, &later, alarm_event, NULL);
+}
+
+// Fires the first event and arms the second
+static void bench_rtc_alarm_service(void)
+{
+	rtc_alarm_service(&scheduler, &alarm_base);
+}
+
+struct benchmark
+{
+	const char *name;
+	void (*function)(void);
+	// Optional state to set up before the measured call, not counted
+	void (*setup)(void);
+	// Maximum SPI transactions allowed per call
+	uint64_t budget;
+	// Optional check of the simulated registers after the measured call
+	bool (*verify)(void);
+};
+
+static const struct benchmark benchmarks[] = {
+	{ .name = "rtc_cache_init", .function = bench_rtc_cache_init, .budget = 1 },
+	{ .name = "disable_pins", .function = bench_disable_pins, .budget = 2, .verify = verify_disable_pins },
+	{ .name = "disable_pins_all_on", .function = bench_disable_pins, .setup = setup_disable_pins, .budget = 5, .verify = verify_disable_pins },
+	{ .name = "configure_alarm", .function = bench_configure_alarm, .budget = 2 },
+	{ .name = "configure_countdown", .function = bench_configure_countdown, .budget = 2 },
+	{ .name = "command_init", .function = bench_initialize_rtc, .budget = 6, .verify = verify_initialize_rtc },
+	{ .name = "configure_periodic_timer", .function = bench_configure_periodic_timer, .budget = 3 },
+	{ .name = "rtc_alarm_schedule", .function = bench_rtc_alarm_schedule, .budget = 4 },
+	{ .name = "rtc_alarm_service", .function = bench_rtc_alarm_service, .setup = setup_rtc_alarm_service, .budget = 2 },
+	{ .name = "rtc_config_save", .function = bench_rtc_config_save, .budget = 1 },
+	{ .name = "rtc_config_init", .function = bench_rtc_config_init, .setup = bench_rtc_config_save, .budget = 1 },
+	{ .name = "rtc_config_restore", .function = bench_rtc_config_init, .setup = setup_rtc_config_restore, .budget = 4, .verify = verify_rtc_config_restore },
+	{ .name = "rtc_rc_calibration_save", .function = bench_rtc_rc_calibration_save, .budget = 1 },
+	{ .name = "rtc_rc_calibration_load", .function = bench_rtc_rc_calibration_load, .setup = bench_rtc_rc_calibration_save, .budget = 1, .verify = verify_rtc_rc_calibration_load },
+	{ .name = "rtc_log_append", .function = bench_rtc_log_append, .setup = setup_rtc_log, .budget = 1, .verify = verify_rtc_log_append },
+	{ .name = "rtc_log_read", .function = bench_rtc_log_read, .setup = setup_rtc_log, .budget = 1 },
+	{ .name = "rtc_snapshot_take", .function = bench_rtc_snapshot_take, .setup = setup_rtc_snapshot, .budget = 1 },
+};
+
+static uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ull + end->tv_nsec - start->tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	bool check = argc > 1 && strcmp(argv[1], "--check") == 0;
+	am1815_init(&rtc, NULL);
+
+	// The helpers report what they do on stdout, keep that out of the results
+	fflush(stdout);
+	int results = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+	FILE *out = fdopen(results, "w");
+
+	int status = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(benchmarks); ++i)
+	{
+		const struct benchmark *bench = &benchmarks[i];
+		dup2(null, STDOUT_FILENO);
+
+		// One call from power-on defaults, right after the startup cache
+		// fill, gives the per-call traffic
+		am1815_sim_reset();
+		rtc_cache_init(&cache, &rtc);
+		if (bench->setup)
+			bench->setup();
+		am1815_sim_clear_stats();
+		bench->function();
+		fflush(stdout);
+		struct am1815_sim_stats stats = am1815_sim_get_stats();
+		bool verified = !bench->verify || bench->verify();
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t j = 0; j < ITERATIONS; ++j)
+			bench->function();
+		fflush(stdout);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		dup2(results, STDOUT_FILENO);
+		fprintf(out, "%s transactions=%"PRIu64" reads=%"PRIu64" writes=%"PRIu64
+			" bytes_read=%"PRIu64" bytes_written=%"PRIu64" rejected=%"PRIu64
+			" ns_per_call=%"PRIu64"\n",
+			bench->name, stats.transactions, stats.reads, stats.writes,
+			stats.bytes_read, stats.bytes_written, stats.rejected_writes,
+			elapsed_ns(&start, &end) / ITERATIONS);
+
+		if (check && stats.transactions > bench->budget)
+		{
+			fprintf(out, "FAIL: %s used %"PRIu64" transactions, budget is %"PRIu64"\n",
+				bench->name, stats.transactions, bench->budget);
+			status = 1;
+		}
+		if (check && stats.rejected_writes)
+		{
+			fprintf(out, "FAIL: %s wrote a protected register without its key\n",
+				bench->name);
+			status = 1;
+		}
+		if (check && !verified)
+		{
+			fprintf(out, "FAIL: %s left the RTC registers in the wrong state\n",
+				bench->name);
+			status = 1;
+		}
+	}
+
+	fclose(out);
+	close(null);
+	return status;
+}
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#include <spi_rate.h>
+
+#include <clock.h>
+
+#include <am1815.h>
+#include <spi.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// User RAM, the only registers that can be written freely
+#define TEST_ADDR 0x40
+#define TEST_SIZE 0xC0
+
+// ID0 and ID1 read back as fixed part numbers
+#define ID_ADDR 0x28
+#define ID0 0x18
+#define ID1 0x15
+
+const uint32_t spi_rates[SPI_RATE_COUNT] = {
+	250000u, 500000u, 1000000u, 2000000u, 3000000u, 4000000u, 6000000u, 8000000u,
+};
+
+// Stuck-at, alternating, and address-dependent patterns, the last two catch
+// shifted or dropped bits between bytes
+static uint8_t pattern_byte(unsigned pattern, size_t i)
+{
+	switch (pattern)
+	{
+	case 0:
+		return 0x00;
+	case 1:
+		return 0xFF;
+	case 2:
+		return i & 1 ? 0xAA : 0x55;
+	case 3:
+		return i & 1 ? 0x55 : 0xAA;
+	case 4:
+		return 1u << (i % 8);
+	default:
+		return (uint8_t)(i * 37 + 0xA5);
+	}
+}
+
+#define PATTERNS 6
+
+static void set_rate(struct spi_bus *bus, struct spi_device **device, struct am1815 *rtc, uint32_t hz)
+{
+	// The driver reconfigures the chip select's clock when asked for it again
+	*device = spi_device_get_instance(bus, SPI_CS_3, hz);
+	am1815_init(rtc, *device);
+}
+
+// Count the bytes of the RAM and the ID registers that read back different
+// from what is known to be there, with bulk and single register reads
+static uint32_t check_reads(struct am1815 *rtc, const uint8_t *expected)
+{
+	uint32_t errors = 0;
+	uint8_t data[TEST_SIZE];
+	am1815_read_bulk(rtc, TEST_ADDR, data, sizeof(data));
+	for (size_t i = 0; i < TEST_SIZE; ++i)
+		errors += data[i] != expected[i];
+
+	// Single register accesses have their own framing, sample a few
+	for (size_t i = 0; i < TEST_SIZE; i += 61)
+		errors += am1815_read_register(rtc, TEST_ADDR + i) != expected[i];
+	errors += am1815_read_register(rtc, ID_ADDR) != ID0;
+	errors += am1815_read_register(rtc, ID_ADDR + 1) != ID1;
+	return errors;
+}
+
+// Returns true if a pattern readback failed, leaving the RAM holding a
+// pattern. The clock is bad then, so the caller restores the RAM at another.
+static bool test_rate(struct am1815 *rtc, struct clock *clock, const uint8_t *saved,
+	struct spi_rate_result *result)
+{
+	uint8_t data[TEST_SIZE];
+	uint64_t bulk_ticks = 0;
+	unsigned bulk_reads = 0;
+	bool written = false;
+	result->errors = 0;
+	for (unsigned round = 0; round < SPI_RATE_ROUNDS && !result->errors; ++round)
+	{
+		// Reads first, writing at a clock that garbles the address byte
+		// could hit the time or control registers
+		uint64_t start = clock_ticks(clock);
+		result->errors += check_reads(rtc, saved);
+		bulk_ticks += clock_ticks(clock) - start;
+		bulk_reads += 1;
+		if (result->errors)
+			break;
+
+		for (unsigned pattern = 0; pattern < PATTERNS && !result->errors; ++pattern)
+		{
+			for (size_t i = 0; i < TEST_SIZE; ++i)
+				data[i] = pattern_byte(pattern, i);
+			am1815_write_bulk(rtc, TEST_ADDR, data, sizeof(data));
+			written = true;
+			result->errors += check_reads(rtc, data);
+		}
+		// Every pattern came back intact, so the clock can be trusted to
+		// put the saved contents back for the next round's reads
+		if (!result->errors)
+		{
+			am1815_write_bulk(rtc, TEST_ADDR, saved, TEST_SIZE);
+			written = false;
+		}
+	}
+	result->bulk_ns = bulk_ticks * 1000000000 / clock->rate / bulk_reads;
+	return written;
+}
+
+uint32_t spi_rate_select(struct spi_bus *bus, struct spi_device **device, struct am1815 *rtc,
+	struct clock *clock, struct spi_rate_result *results)
+{
+	uint8_t saved[TEST_SIZE];
+	set_rate(bus, device, rtc, spi_rates[0]);
+	am1815_read_bulk(rtc, TEST_ADDR, saved, sizeof(saved));
+
+	for (size_t i = 0; i < SPI_RATE_COUNT; ++i)
+	{
+		results[i].hz = spi_rates[i];
+		results[i].tested = false;
+		results[i].errors = 0;
+		results[i].bulk_ns = 0;
+	}
+
+	// Stop at the first failure, a faster clock passing after a slower one
+	// failed is luck
+	uint32_t selected = 0;
+	bool written = false;
+	for (size_t i = 0; i < SPI_RATE_COUNT && spi_rates[i] <= SPI_RATE_MAX; ++i)
+	{
+		set_rate(bus, device, rtc, spi_rates[i]);
+		results[i].tested = true;
+		written = test_rate(rtc, clock, saved, &results[i]);
+		if (results[i].errors)
+			break;
+		selected = spi_rates[i];
+	}
+
+	// Restore at a clock that passed. If none did, the slowest one at least
+	// read back clean before it wrote anything.
+	if (written)
+	{
+		set_rate(bus, device, rtc, selected ? selected : spi_rates[0]);
+		am1815_write_bulk(rtc, TEST_ADDR, saved, sizeof(saved));
+	}
+
+	set_rate(bus, device, rtc, selected ? selected : SPI_RATE_SAFE);
+	return selected;
+}
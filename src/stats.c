@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+#include <stats.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+struct stats_probe stats_probes[STATS_PROBES];
+
+const char *const stats_probe_names[STATS_PROBES] = {
+	[STATS_READ_TIME] = "read_time",
+	[STATS_WRITE_TIME] = "write_time",
+	[STATS_STATUS_READ] = "status_read",
+	[STATS_UART_WRITE] = "uart_write",
+};
+
+#ifdef RTC_STATS
+
+void stats_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void stats_record(struct stats_probe *probe, uint32_t start)
+{
+	uint32_t cycles = DWT->CYCCNT - start;
+	unsigned bucket = cycles ? 31 - __builtin_clz(cycles) : 0;
+	probe->buckets[bucket] += 1;
+	if (!probe->count || cycles < probe->min)
+		probe->min = cycles;
+	if (cycles > probe->max)
+		probe->max = cycles;
+	probe->count += 1;
+}
+
+// Upper bound of the bucket holding the given fraction of the samples, in
+// percent
+static uint32_t percentile(const struct stats_probe *probe, unsigned percent)
+{
+	uint64_t rank = ((uint64_t)probe->count * percent + 99) / 100;
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < STATS_BUCKETS; ++i)
+	{
+		seen += probe->buckets[i];
+		if (seen >= rank)
+		{
+			uint32_t bound = i == 31 ? UINT32_MAX : (2u << i) - 1;
+			if (bound > probe->max)
+				return probe->max;
+			return bound < probe->min ? probe->min : bound;
+		}
+	}
+	return probe->max;
+}
+
+bool stats_summarize(const struct stats_probe *probe, struct stats_summary *summary)
+{
+	if (!probe->count)
+		return false;
+	summary->count = probe->count;
+	summary->min = probe->min;
+	summary->max = probe->max;
+	summary->p50 = percentile(probe, 50);
+	summary->p99 = percentile(probe, 99);
+	return true;
+}
+
+void stats_reset(struct stats_probe *probe)
+{
+	memset(probe, 0, sizeof(*probe));
+}
+
+#endif
@@ -0,0 +1,189 @@
+# SPDX-License-Identifier: Apache-2.0
+# SPDX-FileCopyrightText 2023 Gabriel Marcano
+
+"""
+Keeps a set of RedBoards within an error bound of the host clock while
+talking to them as little as possible. Every device has a history of offset
+measurements, from which the Allan deviation of its RTC is computed. The next
+sync of each device is scheduled as late as its predicted time error allows,
+with just enough ping exchanges to measure the offset within the bound, so
+stable boards are polled rarely and noisy ones more often.
+"""
+
+import argparse
+import heapq
+import json
+import math
+import time
+import numpy
+import serial
+from server_test_time_redboard import ping_burst
+
+# Samples kept per device
+HISTORY_SIZE = 500
+# Most exchanges a ping_burst can run
+MAX_TRIALS = 100
+MIN_TRIALS = 4
+# change_time adjust only steps by whole hundredths
+STEP = 0.01  # in seconds
+
+def allan_deviations(times, phases):
+    """
+    Allan deviation of the RTC's fractional frequency from its time error
+    samples, as a list of (tau, adev). Samples are irregularly spaced, so each
+    averaging time is the mean spacing of the samples used for it, taking every
+    sample, every second one, every fourth one, and so on.
+    """
+    result = []
+    m = 1
+    while len(times) > 2 * m:
+        t = numpy.array(times[::m])
+        x = numpy.array(phases[::m])
+        y = numpy.diff(x) / numpy.diff(t)
+        avar = 0.5 * numpy.mean(numpy.diff(y) ** 2)
+        result.append((numpy.mean(numpy.diff(t)), math.sqrt(avar)))
+        m *= 2
+    return result
+
+class Device:
+    def __init__(self, port, history):
+        self.port = port
+        self.ser = serial.Serial(port)
+        self.ser.baudrate = 115200
+        # Time error samples with all corrections so far undone, so they
+        # describe the free-running RTC
+        self.times = history.get("times", [])
+        self.phases = history.get("phases", [])
+        self.correction = history.get("correction", 0.0)
+        # Standard deviation of single ping exchanges
+        self.noise = history.get("noise", None)
+
+    def history(self):
+        return {
+            "times": self.times[-HISTORY_SIZE:],
+            "phases": self.phases[-HISTORY_SIZE:],
+            "correction": self.correction,
+            "noise": self.noise,
+        }
+
+    def measure(self, trials):
+        offsets = ping_burst(self.ser, trials)
+        offset = float(numpy.mean(offsets))
+        noise = float(numpy.std(offsets))
+        # Smooth the noise estimate over syncs
+        self.noise = noise if self.noise is None else 0.8 * self.noise + 0.2 * noise
+        self.times.append(time.time())
+        self.phases.append(offset + self.correction)
+        return offset
+
+    def step(self, offset):
+        """
+        Steps the RTC by offset, returning the part actually applied
+        """
+        self.ser.reset_input_buffer()
+        self.ser.write(bytearray(f"change_time {offset} adjust\r\n", 'utf-8'))
+        while True:
+            line = self.ser.readline().decode('utf-8').strip()
+            if line.startswith("applied"):
+                applied = int(line.split()[1]) / 1000000
+                self.correction += applied
+                return applied
+            if line.startswith("Error"):
+                print(f"{self.port}: {line}")
+                return 0.0
+
+    def trials(self, bound):
+        """
+        Exchanges needed to measure the offset within a third of the bound
+        """
+        if self.noise is None:
+            return MAX_TRIALS
+        needed = math.ceil((self.noise / (bound / 3)) ** 2)
+        return min(MAX_TRIALS, max(MIN_TRIALS, needed))
+
+    def predicted_error(self, interval, trials):
+        """
+        Expected time error an interval after a sync, from the frequency
+        offset, the frequency instability, and the measurement noise
+        """
+        # Deterministic frequency offset, from a linear fit of the history
+        drift = numpy.polyfit(self.times, self.phases, 1)[0]
+
+        # Power law fit of the Allan deviation, to extrapolate it. The slope
+        # is kept between white PM and random walk FM.
+        deviations = allan_deviations(self.times, self.phases)
+        taus = numpy.log([tau for tau, _ in deviations])
+        adevs = numpy.log([max(adev, 1e-12) for _, adev in deviations])
+        if len(deviations) > 1:
+            slope, intercept = numpy.polyfit(taus, adevs, 1)
+            slope = min(0.5, max(-1.0, slope))
+        else:
+            slope, intercept = 0.0, adevs[0]
+        adev = math.exp(intercept + slope * math.log(interval))
+
+        measurement = self.noise / math.sqrt(trials)
+        return math.sqrt((drift * interval) ** 2 + (adev * interval) ** 2 + measurement ** 2)
+
+    def next_interval(self, bound, trials, shortest, longest):
+        """
+        Longest interval over which the predicted error stays in the bound
+        """
+        if len(self.times) < 3:
+            return shortest
+        interval = shortest
+        candidate = shortest
+        while candidate <= longest:
+            if self.predicted_error(candidate, trials) > bound:
+                break
+            interval = candidate
+            candidate *= 1.25
+        return interval
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("ports", nargs='+', help="serial ports of the RedBoards")
+    parser.add_argument("--bound", type=float, default=0.01,
+        help="largest time error to allow, in seconds")
+    parser.add_argument("--min-interval", type=float, default=10,
+        help="shortest time between syncs of a device, in seconds")
+    parser.add_argument("--max-interval", type=float, default=86400,
+        help="longest time between syncs of a device, in seconds")
+    parser.add_argument("--history", default="sync_history.json",
+        help="JSON file the per device histories are kept in")
+    args = parser.parse_args()
+
+    try:
+        with open(args.history) as f:
+            histories = json.load(f)
+    except FileNotFoundError:
+        histories = {}
+
+    devices = {port: Device(port, histories.get(port, {})) for port in args.ports}
+    time.sleep(0.5)
+
+    queue = [(time.time(), port) for port in devices]
+    heapq.heapify(queue)
+    while True:
+        due, port = heapq.heappop(queue)
+        time.sleep(max(0, due - time.time()))
+        device = devices[port]
+
+        trials = device.trials(args.bound)
+        offset = device.measure(trials)
+        # Only whole hundredths can be stepped, smaller offsets are left
+        applied = 0.0
+        if abs(offset) >= STEP / 2:
+            applied = device.step(offset)
+
+        interval = device.next_interval(args.bound, device.trials(args.bound),
+            args.min_interval, args.max_interval)
+        print(f"{port}: offset {offset * 1e3:.3f} ms, stepped {applied * 1e3:.0f} ms, "
+            f"{trials} trials, next sync in {interval:.0f} s")
+
+        histories[port] = device.history()
+        with open(args.history, 'w') as f:
+            json.dump(histories, f)
+        heapq.heappush(queue, (time.time() + interval, port))
+
+if __name__ == "__main__":
+    main()
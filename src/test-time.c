@@ -1,9 +1,18 @@
-// test time synchronization
+// SPDX-License-Identifier: Apache-2.0
+// SPDX-FileCopyrightText: Gabriel Marcano, 2023
+
+// On-target benchmark suite, built as its own firmware image. It measures SPI
+// single register versus bulk reads at several bus clocks, the latency of
+// writing and reading back the time, how precisely hundredths rollovers are
+// detected, and the UART round trip to the host. Every result is one line of
+// `name key=value ...` with integer values, like spi_bench on the host, so
+// src/bench_redboard.py can record them release over release.
 
 #include <rtc.h>
+#include <clock.h>
 
-#include <cli.h>
 #include <uart.h>
+#include <spi.h>
 #include <syscalls.h>
 
 #include "am_mcu_apollo.h"
@@ -13,17 +22,34 @@
 #include <sys/time.h>
 
 #include <string.h>
-#include <assert.h>
-#include <math.h>
 #include <stdio.h>
-#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 
-struct uart uart;
+#define ARRAY_SIZE(ARG) (sizeof(ARG)/sizeof(*ARG))
+
+// Bus clocks to compare, the AM1815 tops out at 2 MHz
+static const uint32_t spi_clocks[] = { 250000u, 500000u, 1000000u, 2000000u };
+
+// Registers read by the SPI benchmark, user RAM so the reads have no side
+// effects
+#define SPI_BENCH_ADDR 0x40
+#define SPI_BENCH_SIZE 64
+#define SPI_BENCH_ROUNDS 50
+
+#define LATENCY_TRIALS 100
+#define ROLLOVER_TRIALS 100
+#define UART_TRIALS 100
+
+// How long to wait for the host to echo a byte, in microseconds
+#define UART_TIMEOUT 500000
+
+struct uart *uart;
 struct am1815 rtc;
-struct spi_bus spi;
-struct spi_device rtc_spi;
-struct cli cli;
+struct clock mcu_clock;
+struct spi_bus *spi;
+struct spi_device *rtc_spi;
 
 __attribute__((constructor))
 static void redboard_init(void)
@@ -36,46 +62,224 @@ static void redboard_init(void)
 	am_hal_sysctrl_fpu_enable();
 	am_hal_sysctrl_fpu_stacking_enable(true);
 
-	spi_bus_init(&spi, 0);
-	spi_bus_enable(&spi);
-	spi_bus_init_device(&spi, &rtc_spi, SPI_CS_3, 2000000u);
-	am1815_init(&rtc, &rtc_spi);
+	spi = spi_bus_get_instance(SPI_BUS_0);
+	spi_bus_enable(spi);
+	rtc_spi = spi_device_get_instance(spi, SPI_CS_3, 2000000u);
+	am1815_init(&rtc, rtc_spi);
+	clock_init(&mcu_clock, &rtc);
 
-	// cli_init(&cli);
-	uart_init(&uart, UART_INST0);
-	syscalls_uart_init(&uart);
+	uart = uart_get_instance(UART_INST0);
+	syscalls_uart_init(uart);
 	syscalls_rtc_init(&rtc);
 
 	// After init is done, enable interrupts
 	am_hal_interrupt_master_enable();
 }
 
-__attribute__((destructor))
-static void redboard_shutdown(void)
+// Running min, max, and mean of a measurement in counter ticks
+struct summary
+{
+	uint64_t min;
+	uint64_t max;
+	uint64_t total;
+	uint32_t count;
+};
+
+static void summary_add(struct summary *summary, uint64_t ticks)
+{
+	if (!summary->count || ticks < summary->min)
+		summary->min = ticks;
+	if (ticks > summary->max)
+		summary->max = ticks;
+	summary->total += ticks;
+	summary->count += 1;
+}
+
+static uint64_t ticks_to_ns(uint64_t ticks)
+{
+	return ticks * 1000000000 / mcu_clock.rate;
+}
+
+// Prints min_ns, mean_ns, and max_ns, with a trailing newline
+static void print_summary(const struct summary *summary)
+{
+	uint64_t mean = summary->count ? summary->total / summary->count : 0;
+	printf(" min_ns=%" PRIu64 " mean_ns=%" PRIu64 " max_ns=%" PRIu64 "\r\n",
+		ticks_to_ns(summary->min), ticks_to_ns(mean), ticks_to_ns(summary->max));
+}
+
+static void bench_spi(uint32_t hz)
+{
+	// The driver reconfigures the chip select's clock when asked for it again
+	rtc_spi = spi_device_get_instance(spi, SPI_CS_3, hz);
+	am1815_init(&rtc, rtc_spi);
+
+	uint8_t data[SPI_BENCH_SIZE];
+	struct summary single = {0};
+	struct summary bulk = {0};
+	for (unsigned round = 0; round < SPI_BENCH_ROUNDS; ++round)
+	{
+		uint64_t start = clock_ticks(&mcu_clock);
+		for (unsigned i = 0; i < SPI_BENCH_SIZE; ++i)
+			data[i] = am1815_read_register(&rtc, SPI_BENCH_ADDR + i);
+		summary_add(&single, clock_ticks(&mcu_clock) - start);
+
+		start = clock_ticks(&mcu_clock);
+		am1815_read_bulk(&rtc, SPI_BENCH_ADDR, data, sizeof(data));
+		summary_add(&bulk, clock_ticks(&mcu_clock) - start);
+	}
+
+	// Throughput from the mean time per round
+	uint64_t single_bps = (uint64_t)SPI_BENCH_SIZE * SPI_BENCH_ROUNDS * mcu_clock.rate / single.total;
+	uint64_t bulk_bps = (uint64_t)SPI_BENCH_SIZE * SPI_BENCH_ROUNDS * mcu_clock.rate / bulk.total;
+	printf("spi_single clock_hz=%lu bytes=%u bytes_per_s=%" PRIu64,
+		(unsigned long)hz, SPI_BENCH_SIZE, single_bps);
+	print_summary(&single);
+	printf("spi_bulk clock_hz=%lu bytes=%u bytes_per_s=%" PRIu64,
+		(unsigned long)hz, SPI_BENCH_SIZE, bulk_bps);
+	print_summary(&bulk);
+}
+
+static void bench_write_read(void)
+{
+	struct summary write = {0};
+	struct summary read = {0};
+	struct summary total = {0};
+	unsigned mismatches = 0;
+
+	// The rewrites lose time, so note the real time against the counter to
+	// put it back afterwards
+	uint64_t before = clock_ticks(&mcu_clock);
+	struct timeval saved = am1815_read_time(&rtc);
+	uint64_t saved_ticks = (before + clock_ticks(&mcu_clock)) / 2;
+
+	struct timeval time = saved;
+	for (unsigned i = 0; i < LATENCY_TRIALS; ++i)
+	{
+		uint64_t start = clock_ticks(&mcu_clock);
+		am1815_write_time(&rtc, &time);
+		uint64_t written = clock_ticks(&mcu_clock);
+		struct timeval back = am1815_read_time(&rtc);
+		uint64_t end = clock_ticks(&mcu_clock);
+		summary_add(&write, written - start);
+		summary_add(&read, end - written);
+		summary_add(&total, end - start);
+
+		// The read comes within a hundredth of the write, so at most one
+		// hundredth can have gone by
+		int64_t elapsed = (back.tv_sec - time.tv_sec) * 1000000 + back.tv_usec - time.tv_usec;
+		if (elapsed < 0 || elapsed > 10000)
+			mismatches += 1;
+		time = back;
+	}
+	printf("write_time trials=%u", LATENCY_TRIALS);
+	print_summary(&write);
+	printf("read_time trials=%u", LATENCY_TRIALS);
+	print_summary(&read);
+	printf("write_read trials=%u mismatches=%u", LATENCY_TRIALS, mismatches);
+	print_summary(&total);
+
+	// Step the RTC back to the saved time advanced by the counter, at a
+	// hundredths rollover so only the hundredths rounding is lost
+	clock_resync(&mcu_clock);
+	int64_t elapsed = (clock_ticks(&mcu_clock) - saved_ticks) * 1000000 / mcu_clock.rate;
+	struct timeval now = clock_now(&mcu_clock);
+	struct timeval real = timeval_add_us(saved, elapsed);
+	int64_t offset = (real.tv_sec - now.tv_sec) * 1000000 + real.tv_usec - now.tv_usec;
+	struct clock_adjustment adjustment;
+	if (!clock_adjust(&mcu_clock, offset, &adjustment))
+		printf("write_read_restore failed=1\r\n");
+}
+
+static void bench_rollover(void)
 {
-	// cli_destroy(&cli);
+	// Each rollover is placed midway between the last poll that saw the old
+	// hundredth and the first that saw the new one, so half the gap between
+	// them bounds the detection error. Consecutive rollovers should then be
+	// exactly 10 ms apart, and the spread of their spacing shows the real
+	// error.
+	struct summary uncertainty = {0};
+	struct summary error = {0};
+	uint64_t nominal = mcu_clock.rate / 100;
+	uint64_t last = 0;
+	for (unsigned i = 0; i <= ROLLOVER_TRIALS; ++i)
+	{
+		uint64_t before = clock_ticks(&mcu_clock);
+		uint8_t start = am1815_read_register(&rtc, 0x00);
+		uint64_t previous = (before + clock_ticks(&mcu_clock)) / 2;
+		uint64_t current;
+		for (;;)
+		{
+			before = clock_ticks(&mcu_clock);
+			uint8_t value = am1815_read_register(&rtc, 0x00);
+			current = (before + clock_ticks(&mcu_clock)) / 2;
+			if (value != start)
+				break;
+			previous = current;
+		}
+		uint64_t rollover = (previous + current) / 2;
+		summary_add(&uncertainty, (current - previous) / 2);
+
+		// The first rollover only starts the measurement
+		if (i)
+		{
+			uint64_t spacing = rollover - last;
+			summary_add(&error, spacing > nominal ? spacing - nominal : nominal - spacing);
+		}
+		last = rollover;
+	}
+	printf("rollover_bound trials=%u", ROLLOVER_TRIALS + 1);
+	print_summary(&uncertainty);
+	printf("rollover_error trials=%u", ROLLOVER_TRIALS);
+	print_summary(&error);
+}
+
+static void bench_uart(void)
+{
+	// The host echoes every byte back, see src/bench_redboard.py
+	printf("uart_ready\r\n");
+	fflush(stdout);
+
+	struct summary rtt = {0};
+	unsigned lost = 0;
+	for (unsigned i = 0; i < UART_TRIALS; ++i)
+	{
+		uint8_t byte = '!';
+		uint64_t start = clock_ticks(&mcu_clock);
+		uint64_t deadline = start + (uint64_t)UART_TIMEOUT * mcu_clock.rate / 1000000;
+		uart_write(uart, &byte, 1);
+		uint64_t now;
+		bool received;
+		do
+		{
+			received = uart_read(uart, &byte, 1) == 1;
+			now = clock_ticks(&mcu_clock);
+		} while (!received && now < deadline);
+
+		if (received)
+			summary_add(&rtt, now - start);
+		else
+			lost += 1;
+	}
+	printf("\r\nuart_rtt trials=%u lost=%u", UART_TRIALS, lost);
+	print_summary(&rtt);
 }
 
 int main(void)
 {
-    // test am1815_write_time
-    struct timeval curr_time = am1815_read_time(&rtc);
-    am_util_stdio_printf("Time before change: %llu seconds, %ld microseconds\r\n", curr_time.tv_sec, curr_time.tv_usec);
-
-    struct timeval new_time = {.tv_sec = 1000003000, .tv_usec = 40};
-    am1815_write_time(&rtc, &new_time);
-    curr_time = am1815_read_time(&rtc);
-    am_util_stdio_printf("Time after change: %llu seconds, %ld microseconds\r\n", curr_time.tv_sec, curr_time.tv_usec);
-
-    // run test-time-server.py
-    am_util_stdio_printf("Begin delay...\r\n");
-    am_util_delay_ms(3000);
-    am_util_stdio_printf("...End delay\r\n");
-
-    int buffer_size = 50;
-    unsigned char buffer[buffer_size];
-    uart_read(&uart, buffer, buffer_size);
-    am_util_stdio_printf("Received from serial: %s\r\n", buffer);
-    long seconds;
-    // strtol(&buffer, &seconds);
-}
\ No newline at end of file
+	printf("bench start clock_rate=%lu\r\n", (unsigned long)mcu_clock.rate);
+
+	for (size_t i = 0; i < ARRAY_SIZE(spi_clocks); ++i)
+		bench_spi(spi_clocks[i]);
+	// The remaining benchmarks run at the clock the CLI firmware uses
+	rtc_spi = spi_device_get_instance(spi, SPI_CS_3, 2000000u);
+	am1815_init(&rtc, rtc_spi);
+
+	bench_write_read();
+	bench_rollover();
+	bench_uart();
+
+	printf("bench done\r\n");
+	for (;;)
+		am_hal_sysctrl_sleep(AM_HAL_SYSCTRL_SLEEP_DEEP);
+}
@@ -11,8 +11,79 @@ import math
 import argparse
 import serial
 import time
-from constant_time_redboard import constant_time
-from server_test_time_redboard import server_test_time
+import numpy
+from constant_time_redboard import scheduled_time
+from server_test_time_redboard import ping_burst
+
+# Offset the sync has to reach, and the confidence it has to reach it with
+TARGET = 0.01  # in seconds
+# change_time adjust only steps by whole hundredths
+STEP = 0.01  # in seconds
+# Ping exchanges per burst, each is fed to the filter on its own
+BURST = 8
+# Give up if the sync takes longer than this
+TIMEOUT = 60  # in seconds
+
+class OffsetFilter:
+    """
+    Kalman filter tracking the RTC's offset from the host (host minus RTC) and
+    its drift, updated with every ping exchange
+    """
+
+    def __init__(self, noise):
+        # State: offset in seconds, drift in seconds per second
+        self.x = numpy.zeros(2)
+        # Nothing is known about the offset yet, and RTCs drift < 1000 ppm
+        self.P = numpy.diag([1.0, 1e-6])
+        # Variance of a single exchange's offset
+        self.R = noise ** 2
+        # Frequency random walk of a crystal, in (s/s)^2 per second
+        self.q = 1e-18
+        self.time = None
+
+    def predict(self, now):
+        if self.time is not None:
+            dt = now - self.time
+            F = numpy.array([[1, dt], [0, 1]])
+            Q = self.q * numpy.array([[dt ** 3 / 3, dt ** 2 / 2], [dt ** 2 / 2, dt]])
+            self.x = F @ self.x
+            self.P = F @ self.P @ F.T + Q
+        self.time = now
+
+    def update(self, now, offset):
+        self.predict(now)
+        # Only the offset is measured
+        S = self.P[0, 0] + self.R
+        K = self.P[:, 0] / S
+        self.x = self.x + K * (offset - self.x[0])
+        self.P = self.P - numpy.outer(K, self.P[0, :])
+
+    def step(self, applied):
+        # Stepping the RTC forward shrinks the offset by the same amount
+        self.x[0] -= applied
+
+    @property
+    def offset(self):
+        return self.x[0]
+
+    @property
+    def deviation(self):
+        return math.sqrt(self.P[0, 0])
+
+def change_time(ser, offset):
+    """
+    Steps the RTC by offset at a hundredths rollover, so nothing is lost
+    between the device reading and writing the RTC. Returns the step applied.
+    """
+    ser.reset_input_buffer()
+    ser.write(bytearray(f"change_time {offset} adjust\r\n", 'utf-8'))
+    while True:
+        line = ser.readline().decode('utf-8').strip()
+        if line.startswith("applied"):
+            return int(line.split()[1]) / 1000000
+        if line.startswith("Error"):
+            print(line)
+            return 0.0
 
 def update_rtc(port):
     ser = serial.Serial(port) # open serial port
@@ -22,16 +93,46 @@ def update_rtc(port):
     ser.reset_input_buffer()
     ser.reset_output_buffer()
 
-    # Gets the timestamps from the server
-    constant_time(port, ser)
+    start = time.monotonic()
+
+    # Sets the time once, at an instant the device schedules itself
+    scheduled_time(ser)
+
+    # The first burst also measures how noisy single exchanges are
+    offsets = ping_burst(ser, BURST)
+    estimator = OffsetFilter(max(numpy.std(offsets), 1e-4))
+    samples = 0
+    steps = 0
+
+    while time.monotonic() - start < TIMEOUT:
+        now = time.time()
+        for offset in offsets:
+            estimator.update(now, offset)
+        samples += len(offsets)
+
+        offset = estimator.offset
+        deviation = estimator.deviation
+        if abs(offset) < TARGET and 3 * deviation < TARGET:
+            elapsed = time.monotonic() - start
+            print(f"Converged in {elapsed:.2f} s, {samples} pings, {steps} steps: "
+                f"offset {offset * 1e3:.3f} ms +- {deviation * 1e3:.3f} ms")
+            return offset
+
+        # Step as soon as the offset is both steppable and known well enough
+        # that the step won't overshoot
+        if abs(offset) >= STEP / 2 and 3 * deviation < abs(offset):
+            estimator.step(change_time(ser, offset))
+            steps += 1
 
-    # Checks the offset
-    offset = server_test_time(port, 100, ser)
+        offsets = ping_burst(ser, BURST)
 
-    # If offset is too big keep changing the time
-    while math.fabs(offset) > 0.01:
-        # Changes the time by the offset
-        ser.write(bytearray(f"change_time {offset}\r\n", 'utf-8'))
-        offset = server_test_time(port, 100, ser)
+    print(f"Did not converge in {TIMEOUT} s: offset {estimator.offset * 1e3:.3f} ms "
+        f"+- {estimator.deviation * 1e3:.3f} ms")
+    return estimator.offset
 
-update_rtc("/dev/ttyUSB1")
\ No newline at end of file
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("port", nargs='?', default="/dev/ttyUSB1",
+        help="serial port of the RedBoard")
+    args = parser.parse_args()
+    update_rtc(args.port)